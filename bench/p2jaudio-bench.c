@@ -0,0 +1,424 @@
+/**
+
+Name: p2jaudio-bench
+Description: Microbenchmarks of the audio kernels of p2jaudio (see 'p2jaudio_ring.h' and 'p2jaudio_resample.h'),
+for catching performance regressions between releases.
+Every kernel is timed for channel counts 1..64 and period sizes 16..4096,
+the result is printed as CSV on stdout (one line per kernel, channel count and period size),
+in nanoseconds per frame (so for all channels together).
+Run it with 'make bench', which writes the result to 'bench.csv' as well.
+
+Kernels:
+deinterleave        copying one period from the interleaved buffer to the channel buffers
+ring_write          writing one pulse read into the ring, without wraparound
+ring_write_wrap     the same, split at the end of the ring
+ring_read           reading one jack period from the ring, without wraparound
+ring_read_wrap      the same, split at the end of the ring
+ring_read_drop      reading one jack period while dropping (crossfading) a quarter of it
+callback_checks     the locking, state checks and latency control done by p2jaudio_pipe_process() on each callback
+callback_producer   the same checks followed by reading the period, while a second thread writes into the ring
+                    and publishes its progress, the way the pulse thread does (see 'p2jaudio_pipe.h'),
+                    the difference with callback_checks plus ring_read is the cost of sharing the ring
+                    between the cores (only on more than one core)
+callback_shared     the baseline of callback_producer: the checks and reading the period (without the latency control)
+                    on a pipe laid out like it was before its fields were grouped by cache line, with the ring indices,
+                    the state and the progress of pulse on one line, and a producer that writes under bufferMutex,
+                    the difference with callback_producer is the cross-core traffic saved by the layout
+                    (only on more than one core)
+resample_QUALITY    resampling one pulse read from 44100Hz to 48000Hz (see '-R'), per frame read,
+                    so divide by the amount of channels for the cost per channel
+
+**/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "p2jaudio_pipe.h"
+#include "p2jaudio_ring.h"
+#include "p2jaudio_control.h"
+#include "p2jaudio_resample.h"
+
+
+#define MIN_CHANNELS 1
+#define MAX_CHANNELS 64
+#define MIN_PERIOD_SIZE 16
+#define MAX_PERIOD_SIZE 4096
+
+/* Every measurement is repeated until it takes at least this long */
+#define DEFAULT_MIN_TIME 0.01
+#define REPETITIONS 5
+
+/* Ring of a few periods, like the one of p2jaudio with a small latency */
+#define RING_PERIODS 4
+
+/* The most common conversion, a 44.1kHz device with jack at 48kHz */
+#define RESAMPLE_IN_RATE 44100
+#define RESAMPLE_OUT_RATE 48000
+
+
+typedef void (*kernel_t)(int nChannels, int frames);
+
+/* A pipe with the layout of p2jaudio, of which only the buffer and the fields of the callbacks are set */
+static p2jaudio_pipe*	pipe;
+static float*			samples;
+static float*			chnlBuffer;
+static float*			chnls[MAX_CHANNELS];
+static float*			resampleBuffer;
+static p2jaudio_resampler*	resampler;
+
+/* Whether the producer thread writes into the ring */
+static volatile int		producerRunning;
+
+/* The layout of the pipe before it was grouped by cache line, for callback_shared:
+   the fields of both sides share a line, and the ring is written and read under bufferMutex */
+typedef struct {
+	int				todo;
+	int				state;
+	int				pulsePeriodSize;
+	int				size;
+	uint64_t		writeIndex;
+	uint64_t		readIndex;
+	long long		pulseFrames;
+	pthread_mutex_t	bufferMutex;
+	float*			buffer;
+} sharedLayout;
+
+static sharedLayout		shared CACHE_ALIGNED;
+
+
+static double getTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+}
+
+/* Keeps the compiler from optimizing the kernels away */
+static void clobber() {
+	__asm__ volatile ("" : : "r" (pipe->pulseRing.buffer), "r" (chnls[0]) : "memory");
+}
+
+/* Sets the ring to 'fill' unread samples, starting at 'readIndex' */
+static void setRing(uint64_t readIndex, int fill) {
+	pipe->pulseRing.readIndex = readIndex;
+	pipe->pulseRing.readIndexCache = readIndex;
+	pipe->pulseRing.writeIndex = readIndex + fill;
+}
+
+
+static void kernel_deinterleave(int nChannels, int frames) {
+	p2jaudio_deinterleave(chnls, nChannels, 0, samples, frames);
+}
+
+static void kernel_ring_write(int nChannels, int frames) {
+	setRing(0, 0);
+	p2jaudio_ring_write(&pipe->pulseRing, samples, nChannels * frames);
+}
+
+static void kernel_ring_write_wrap(int nChannels, int frames) {
+	setRing(pipe->pulseRing.size - nChannels * (frames / 2), 0);
+	p2jaudio_ring_write(&pipe->pulseRing, samples, nChannels * frames);
+}
+
+static void kernel_ring_read(int nChannels, int frames) {
+	setRing(0, pipe->pulseRing.size);
+	p2jaudio_ring_read(&pipe->pulseRing, chnls, nChannels, frames, 0);
+}
+
+static void kernel_ring_read_wrap(int nChannels, int frames) {
+	setRing(pipe->pulseRing.size - nChannels * (frames / 2), pipe->pulseRing.size);
+	p2jaudio_ring_read(&pipe->pulseRing, chnls, nChannels, frames, 0);
+}
+
+static void kernel_ring_read_drop(int nChannels, int frames) {
+	setRing(0, pipe->pulseRing.size);
+	p2jaudio_ring_read(&pipe->pulseRing, chnls, nChannels, frames, frames / 4);
+}
+
+/* Mirrors the start of pipe_processCycle(), up to the reading of the ring, returns whether it reads */
+static int callback_checks(int nChannels, int frames) {
+	if (__atomic_load_n(&pipe->todo, __ATOMIC_ACQUIRE) > -1)
+		return 0;
+
+	pthread_mutex_lock(&pipe->bufferMutex);
+	if (__atomic_load_n(&pipe->state, __ATOMIC_ACQUIRE) < 2 || nChannels * frames != pipe->pulsePeriodSize) {
+		pthread_mutex_unlock(&pipe->bufferMutex);
+		return 0;
+	}
+	int dropFrames;
+	p2jaudio_pipe_controlPeriod(pipe, frames, getTime(), &dropFrames);
+	// As if pulse kept up exactly, so the latency control stays in its steady state
+	pipe->control.missedFrames = 0;
+	return 1;
+}
+
+static void kernel_callback_checks(int nChannels, int frames) {
+	if (!callback_checks(nChannels, frames))
+		return;
+	// Without a producer, as if pulse published a read of a period
+	pipe->pulseFrames += frames;
+	pthread_mutex_unlock(&pipe->bufferMutex);
+}
+
+static void kernel_callback_producer(int nChannels, int frames) {
+	if (!callback_checks(nChannels, frames))
+		return;
+	p2jaudio_ring_read(&pipe->pulseRing, chnls, nChannels, frames, 0);
+	pthread_mutex_unlock(&pipe->bufferMutex);
+}
+
+/* Writes a period whenever it fits below the latency, the way pulse_processRead() writes its reads:
+   under no lock but pulseMutex (around its read from pulse), then writing the ring and publishing the frames.
+   Like the pulse thread, it only reads the line of the reader when the ring looks full. */
+static void* producer_run(void* arg) {
+	p2jaudio_ring* ring = &pipe->pulseRing;
+	const int frames = pipe->periodSize;
+	const int maxSize = pipe->nChannels * (pipe->control.maxFrames - frames);
+	while (__atomic_load_n(&producerRunning, __ATOMIC_RELAXED)) {
+		if (p2jaudio_ring_writerFill(ring) > maxSize) {
+			ring->readIndexCache = __atomic_load_n(&ring->readIndex, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		pthread_mutex_lock(&pipe->pulseMutex);
+		pthread_mutex_unlock(&pipe->pulseMutex);
+		p2jaudio_pipe_publishRead(pipe, samples, frames, 0);
+	}
+	return NULL;
+}
+
+static void kernel_callback_shared(int nChannels, int frames) {
+	if (__atomic_load_n(&shared.todo, __ATOMIC_ACQUIRE) > -1)
+		return;
+
+	pthread_mutex_lock(&shared.bufferMutex);
+	const int size = nChannels * frames;
+	if (shared.state < 2 || size != shared.pulsePeriodSize) {
+		pthread_mutex_unlock(&shared.bufferMutex);
+		return;
+	}
+	// The ring holds a whole number of periods, so a period never wraps.
+	// As p2jaudio_ring_read(), repeat the last period written when less than a period is buffered.
+	if ((int)(shared.writeIndex - shared.readIndex) < size)
+		shared.readIndex = shared.writeIndex - size;
+	p2jaudio_deinterleave(chnls, nChannels, 0, &shared.buffer[shared.readIndex % shared.size], frames);
+	shared.readIndex += size;
+	pthread_mutex_unlock(&shared.bufferMutex);
+}
+
+/* The producer of callback_shared: polls the fill on the shared line, and writes and publishes a period under bufferMutex */
+static void* producer_shared_run(void* arg) {
+	const int frames = pipe->periodSize;
+	const int size = pipe->nChannels * frames;
+	const int maxSize = pipe->nChannels * (pipe->control.maxFrames - frames);
+	while (__atomic_load_n(&producerRunning, __ATOMIC_RELAXED)) {
+		if ((int)(__atomic_load_n(&shared.writeIndex, __ATOMIC_RELAXED) - __atomic_load_n(&shared.readIndex, __ATOMIC_RELAXED)) > maxSize)
+			continue;
+		pthread_mutex_lock(&shared.bufferMutex);
+		memcpy(&shared.buffer[shared.writeIndex % shared.size], samples, sizeof(float) * size);
+		shared.writeIndex += size;
+		shared.pulseFrames += frames;
+		pthread_mutex_unlock(&shared.bufferMutex);
+	}
+	return NULL;
+}
+
+static void kernel_resample(int nChannels, int frames) {
+	p2jaudio_resampler_process(resampler, samples, frames, resampleBuffer);
+}
+
+static const struct {
+	const char*	name;
+	kernel_t	kernel;
+	int			quality;	/* of the resampler to create, -1: none */
+	void*		(*producer)(void* arg);	/* thread that writes into the ring while measuring, or NULL */
+} kernels[] = {
+	{"deinterleave",	kernel_deinterleave,	-1,	NULL},
+	{"ring_write",		kernel_ring_write,		-1,	NULL},
+	{"ring_write_wrap",	kernel_ring_write_wrap,	-1,	NULL},
+	{"ring_read",		kernel_ring_read,		-1,	NULL},
+	{"ring_read_wrap",	kernel_ring_read_wrap,	-1,	NULL},
+	{"ring_read_drop",	kernel_ring_read_drop,	-1,	NULL},
+	{"callback_checks",	kernel_callback_checks,	-1,	NULL},
+	{"callback_producer",	kernel_callback_producer,	-1,	producer_run},
+	{"callback_shared",	kernel_callback_shared,	-1,	producer_shared_run},
+	{"resample_low",	kernel_resample,		P2JAUDIO_RESAMPLE_LOW,	NULL},
+	{"resample_medium",	kernel_resample,		P2JAUDIO_RESAMPLE_MEDIUM,	NULL},
+	{"resample_high",	kernel_resample,		P2JAUDIO_RESAMPLE_HIGH,	NULL},
+	{"resample_best",	kernel_resample,		P2JAUDIO_RESAMPLE_BEST,	NULL},
+};
+
+
+/* Returns the best time per call over a few repetitions, the amount of calls per repetition in '*iterations' */
+static double measure(kernel_t kernel, int nChannels, int frames, double minTime, long* iterations) {
+	long n = 1;
+	double best = 0;
+	long i;
+	int r;
+
+	// Find the amount of calls that takes at least minTime
+	for (;;) {
+		const double startTime = getTime();
+		for (i = 0; i < n; i++) {
+			kernel(nChannels, frames);
+			clobber();
+		}
+		if (getTime() - startTime >= minTime)
+			break;
+		n *= 2;
+	}
+
+	for (r = 0; r < REPETITIONS; r++) {
+		const double startTime = getTime();
+		for (i = 0; i < n; i++) {
+			kernel(nChannels, frames);
+			clobber();
+		}
+		const double time = (getTime() - startTime) / n;
+		if (r == 0 || time < best)
+			best = time;
+	}
+
+	*iterations = n;
+	return best;
+}
+
+int main(int argc, char **argv) {
+	const char* filter = NULL;
+	double minTime = DEFAULT_MIN_TIME;
+	int doesUserNeedHelp = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "k:t:h")) != -1) {
+		switch (c) {
+			case 'k':
+				filter = optarg;
+				break;
+
+			case 't':
+				minTime = atof(optarg);
+				break;
+
+			default:
+				doesUserNeedHelp = 1;
+				break;
+		}
+	}
+
+	if (doesUserNeedHelp || optind != argc || minTime <= 0) {
+		printf (
+"\
+Usage: \t %s [-k KERNEL] [-t SECONDS] \n\
+\n\
+Benchmarks the audio kernels of p2jaudio for channel counts %d..%d and period sizes %d..%d, \n\
+and prints the result as CSV: kernel,channels,period,iterations,ns_per_frame \n\
+\n\
+Options: \n\
+\t -k KERNEL   only benchmark KERNEL, e.g. 'ring_read' \n\
+\t -t SECONDS  minimum duration of each measurement (default: %g) \n\
+\t -h          prints this help-message \n\
+",
+				argv[0], MIN_CHANNELS, MAX_CHANNELS, MIN_PERIOD_SIZE, MAX_PERIOD_SIZE, DEFAULT_MIN_TIME);
+		return 0;
+	}
+
+	// Allocate for the largest case, and fill with something that isn't denormal
+
+	const int maxSize = MAX_CHANNELS * MAX_PERIOD_SIZE;
+	float* ringBuffer = malloc(sizeof(float) * RING_PERIODS * maxSize);
+	samples = malloc(sizeof(float) * maxSize);
+	chnlBuffer = malloc(sizeof(float) * maxSize);
+	resampleBuffer = malloc(sizeof(float) * 2 * maxSize);
+	if (posix_memalign((void**)&pipe, CACHE_LINE_SIZE, sizeof(p2jaudio_pipe)) != 0)
+		pipe = NULL;
+	if (ringBuffer == NULL || samples == NULL || chnlBuffer == NULL || resampleBuffer == NULL || pipe == NULL) {
+		printf ("Failed to allocate the buffers.\n");
+		return 1;
+	}
+	int i;
+	for (i = 0; i < RING_PERIODS * maxSize; i++)
+		ringBuffer[i] = (float)(i % 1000) / 1000;
+	for (i = 0; i < maxSize; i++)
+		samples[i] = (float)(i % 997) / 997;
+
+	memset(pipe, 0, sizeof(p2jaudio_pipe));
+	pthread_mutex_init(&pipe->bufferMutex, NULL);
+	pthread_mutex_init(&pipe->pulseMutex, NULL);
+	pipe->rate = RESAMPLE_OUT_RATE;
+	pipe->todo = -1;
+	pipe->state = 2;
+	pthread_mutex_init(&shared.bufferMutex, NULL);
+	shared.buffer = ringBuffer;
+	shared.todo = -1;
+	shared.state = 2;
+
+	printf ("kernel,channels,period,iterations,ns_per_frame\n");
+
+	int k, nChannels, frames;
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (filter != NULL && strcmp(filter, kernels[k].name) != 0)
+			continue;
+
+		for (nChannels = MIN_CHANNELS; nChannels <= MAX_CHANNELS; nChannels *= 2) {
+			if (kernels[k].quality != -1 &&
+					(resampler = p2jaudio_resampler_new(RESAMPLE_IN_RATE, RESAMPLE_OUT_RATE, nChannels, kernels[k].quality)) == NULL) {
+				printf ("Failed to create the resampler.\n");
+				return 1;
+			}
+			for (frames = MIN_PERIOD_SIZE; frames <= MAX_PERIOD_SIZE; frames *= 2) {
+				for (i = 0; i < nChannels; i++)
+					chnls[i] = &chnlBuffer[i * frames];
+				// As startProcess() does, while neither side runs
+				pipe->nChannels = nChannels;
+				pipe->periodSize = frames;
+				pipe->pulsePeriodSize = nChannels * frames;
+				pipe->pulseFrames = 0;
+				pipe->pulseSwitches = 0;
+				p2jaudio_ring_init(&pipe->pulseRing, ringBuffer, RING_PERIODS * nChannels * frames);
+				pipe->control.benchmarkStatus = 3;
+				p2jaudio_control_init(&pipe->control, RESAMPLE_OUT_RATE, nChannels, frames, frames,
+						RING_PERIODS * frames, (RING_PERIODS - 2) * frames);
+				pipe->control.primed = 1;
+				shared.pulsePeriodSize = nChannels * frames;
+				shared.size = RING_PERIODS * nChannels * frames;
+				shared.writeIndex = shared.readIndex = 0;
+				shared.pulseFrames = 0;
+
+				pthread_t producerThread;
+				if (kernels[k].producer != NULL) {
+					producerRunning = 1;
+					if (pthread_create(&producerThread, NULL, kernels[k].producer, NULL) != 0) {
+						printf ("Failed to create the producer thread.\n");
+						return 1;
+					}
+				}
+
+				long iterations;
+				const double time = measure(kernels[k].kernel, nChannels, frames, minTime, &iterations);
+
+				if (kernels[k].producer != NULL) {
+					producerRunning = 0;
+					pthread_join(producerThread, NULL);
+				}
+				printf ("%s,%d,%d,%ld,%.4f\n", kernels[k].name, nChannels, frames, iterations, 1e9 * time / frames);
+				fflush(stdout);
+			}
+			p2jaudio_resampler_free(resampler);
+			resampler = NULL;
+		}
+	}
+
+	free(ringBuffer);
+	free(samples);
+	free(chnlBuffer);
+	free(resampleBuffer);
+	pthread_mutex_destroy(&pipe->bufferMutex);
+	pthread_mutex_destroy(&pipe->pulseMutex);
+	pthread_mutex_destroy(&shared.bufferMutex);
+	free(pipe);
+	return 0;
+}
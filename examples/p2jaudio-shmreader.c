@@ -0,0 +1,242 @@
+/**
+
+Name: p2jaudio-shmreader
+Description: Example of a local consumer of the shared-memory segment published by
+'p2jaudio -s', see 'p2jaudio_shm.h'.
+It maps the segment read-only and consumes the samples in place (without copying them),
+by default it prints the peak level of each channel twice a second,
+with '-b SECONDS' it benchmarks the throughput of reading from the segment.
+
+**/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "p2jaudio_shm.h"
+
+
+#define POLL_INTERVAL 0.005
+#define PRINT_INTERVAL 0.5
+#define MAX_CHANNELS 64
+
+
+static const p2jaudio_shm_header*	header;
+static size_t						segmentSize;
+
+
+double getTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+}
+
+static int openSegment(const char* name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(p2jaudio_shm_header)) {
+		close(fd);
+		return -1;
+	}
+	segmentSize = st.st_size;
+
+	header = mmap(NULL, segmentSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		header = NULL;
+		return -1;
+	}
+
+	if (header->magic != P2JAUDIO_SHM_MAGIC || header->version != P2JAUDIO_SHM_VERSION ||
+			header->format != P2JAUDIO_SHM_FORMAT_FLOAT32 || header->channels > MAX_CHANNELS ||
+			header->dataOffset + sizeof(float) * header->ringSize > segmentSize) {
+		printf ("'%s' is not a compatible p2jaudio segment.\n", name);
+		munmap((void*)header, segmentSize);
+		header = NULL;
+		return -2;
+	}
+
+	printf ("Opened '%s': %d*%dHz, ring of %d samples.\n", name, header->channels, header->rate, header->ringSize);
+	return 0;
+}
+
+static void closeSegment()
+{
+	munmap((void*)header, segmentSize);
+	header = NULL;
+}
+
+/* Waits until the segment (re)appears, returns -1 when it is not compatible */
+static int waitForSegment(const char* name)
+{
+	int ret;
+	while ((ret = openSegment(name)) == -1)
+		usleep(100000);
+	return ret;
+}
+
+static int monitor(const char* name)
+{
+	float peaks[MAX_CHANNELS];
+	float batchPeaks[MAX_CHANNELS];
+
+	for (;;) {
+		if (waitForSegment(name) != 0)
+			return -1;
+
+		const float* data = p2jaudio_shm_data(header);
+		const int nChannels = header->channels;
+		const uint64_t ringSize = header->ringSize;
+		uint64_t readIndex = p2jaudio_shm_writeIndex(header);
+		double lastPrintTime = getTime();
+		int i;
+
+		memset(peaks, 0, sizeof(peaks));
+
+		while (__atomic_load_n(&header->active, __ATOMIC_ACQUIRE)) {
+			const uint64_t writeIndex = p2jaudio_shm_writeIndex(header);
+			uint64_t index;
+
+			// Consume the samples in place, into the peaks of this batch
+			memset(batchPeaks, 0, sizeof(batchPeaks));
+			for (index = readIndex; index < writeIndex; index++) {
+				const float v = fabsf(data[index % ringSize]);
+				i = index % nChannels;
+				if (v > batchPeaks[i])
+					batchPeaks[i] = v;
+			}
+
+			// Only once they are read, check that they weren't overwritten in the meantime
+			if (p2jaudio_shm_overrun(header, readIndex)) {
+				printf ("Reader overrun: skipped %d samples.\n", (int)(writeIndex - readIndex));
+			} else {
+				for (i = 0; i < nChannels; i++)
+					if (batchPeaks[i] > peaks[i])
+						peaks[i] = batchPeaks[i];
+			}
+			readIndex = writeIndex;
+
+			if (getTime() - lastPrintTime >= PRINT_INTERVAL) {
+				lastPrintTime = getTime();
+				printf ("Peak:");
+				for (i = 0; i < nChannels; i++) {
+					printf (" %6.1fdB", 20 * log10f(peaks[i] + 1e-9f));
+					peaks[i] = 0;
+				}
+				printf ("\n");
+			}
+
+			usleep(POLL_INTERVAL * 1000000);
+		}
+
+		printf ("Segment abandoned by p2jaudio, reopening...\n");
+		closeSegment();
+	}
+}
+
+static int benchmark(const char* name, double duration)
+{
+	if (waitForSegment(name) != 0)
+		return -1;
+
+	const float* data = p2jaudio_shm_data(header);
+	const uint64_t ringSize = header->ringSize;
+	uint64_t readIndex = p2jaudio_shm_writeIndex(header);
+	uint64_t i;
+
+	// Live consumption: follow the writer for the given duration
+
+	long long liveSamples = 0;
+	int overruns = 0;
+	volatile float sink = 0;
+	const double liveStartTime = getTime();
+	while (getTime() - liveStartTime < duration && __atomic_load_n(&header->active, __ATOMIC_ACQUIRE)) {
+		const uint64_t writeIndex = p2jaudio_shm_writeIndex(header);
+		float sum = 0;
+		for (i = readIndex; i < writeIndex; i++)
+			sum += data[i % ringSize];
+		// Only once they are read, check that they weren't overwritten in the meantime
+		if (p2jaudio_shm_overrun(header, readIndex))
+			overruns++;
+		else {
+			sink += sum;
+			liveSamples += writeIndex - readIndex;
+		}
+		readIndex = writeIndex;
+		usleep(POLL_INTERVAL * 1000000);
+	}
+	const double liveTime = getTime() - liveStartTime;
+
+	// Peak throughput: scan the whole ring in place, as a reader that has fallen behind would
+
+	long long scannedSamples = 0;
+	const double scanStartTime = getTime();
+	while (getTime() - scanStartTime < duration / 4) {
+		float sum = 0;
+		for (i = 0; i < ringSize; i++)
+			sum += data[i];
+		sink += sum;
+		scannedSamples += ringSize;
+	}
+	const double scanTime = getTime() - scanStartTime;
+
+	printf ("Live:  %lld samples in %fs = %f samples/s (%f frames/s), %d overruns.\n",
+			liveSamples, liveTime, liveSamples / liveTime, liveSamples / liveTime / header->channels, overruns);
+	printf ("Scan:  %lld samples in %fs = %fMB/s, %fns/sample.\n",
+			scannedSamples, scanTime, sizeof(float) * scannedSamples / scanTime / 1000000, 1e9 * scanTime / scannedSamples);
+
+	closeSegment();
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	double duration = 0;
+	int doesUserNeedHelp = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "b:h")) != -1) {
+		switch (c) {
+			case 'b':
+				duration = atof(optarg);
+				break;
+
+			default:
+				doesUserNeedHelp = 1;
+				break;
+		}
+	}
+
+	if (doesUserNeedHelp || optind != argc - 1 || duration < 0) {
+		printf (
+"\
+Usage: \t %s [-b SECONDS] SEGMENT \n\
+\n\
+Reads the audio of a pipe started with 'p2jaudio -s' from the shared memory segment \n\
+SEGMENT (e.g. '/p2jaudio.p2jaudio') and prints its peak levels. \n\
+\n\
+Options: \n\
+\t -b SECONDS  benchmark the reading throughput during SECONDS, instead of printing levels \n\
+\t -h          prints this help-message \n\
+",
+				argv[0]);
+		return 0;
+	}
+
+	if (duration > 0)
+		return benchmark(argv[optind], duration) == 0 ? 0 : 1;
+	else
+		return monitor(argv[optind]) == 0 ? 0 : 1;
+}
@@ -11,44 +11,41 @@ The name is chosen in accordance with the name of the program 'a2jmidi', where '
 It can be handy when recording from multiple soundcards at the same time,
 however, each device will have its own latency, so realtime manipulation of the signal,
 e.g. live performances, is not really recommended.
+This program is the frontend of libp2jaudio (see 'p2jaudio.h'): it gives the pipe a jack client
+with an output port per channel, and controls it from the command line, signals and stdin.
 
 **/
 
 
 
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <pthread.h>
-#include <math.h>
+#include <semaphore.h>
 #include <time.h>
 #include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include <jack/jack.h>
-#include <pulse/simple.h>
-#include <pulse/error.h>
-
 
-#define DEBUG 0
+#include "p2jaudio.h"
 
 
-#define USE_BENCHMARK 1
-#if (USE_BENCHMARK==1)
-	#define PULSE_MAX_BUFFER_TIME 1.0
-#endif
 
-#define MAX_BUFFER_UNDERRUN_TIME_MULTIPLIER 2.0
-#define MIN_BUFFER_UNDERRUN_AMOUNT 5
+/* Maximum length of a line on stdin, see '-i' */
+#define MAX_COMMAND_LENGTH 256
 
-#define MIN_BENCHMARK_TIME 0.5
-#define MAX_BENCHMARK_TIME 4.0
+/* Interval at which the main thread wakes up, when nothing happens */
+#define WAIT_INTERVAL 0.2
 
 
 
@@ -57,118 +54,44 @@ e.g. live performances, is not really recommended.
 
 static int samplerateChange(jack_nframes_t r, void* arg);
 static int periodSizeChange(jack_nframes_t b, void* arg);
+static int xrunOccurred(void* arg);
 
 static int jack_start(char* sourceName, int nChannels, char** channelNames);
 static int jack_process(jack_nframes_t frames, void* arg);
 static int jack_stop();
 static void jack_shutdown(void* arg);
 
-/** These ones should be replaced by the non-simple pulse lib **/
-static void pulseServer_setProcessCallback(int (*cb)());
-static void pulseServer_start();
-static void pulseServer_run();
-static void pulseServer_stop();
-
-static int pulse_start(char* sourceName, int rate, int nChannels);
-static int pulse_process();
-static int pulse_stop();
-
-int timeToPeriods(double time);
-static int startProcess();
-static int initBenchmark();
-static int updateBenchmarkVariables(int side);
-static int initBuffer();
-static void clearUnderrunVariables();
-static int updateUnderrunVariables(int side);
-static int stopProcess();
-static int softrestartProcess();
-int restartProcess();
+static void commands_start();
+static void* commands_run(void* arg);
 
-int start(char* srcName, int nChnls, char** chlNames);
-int stop();
-
-static int lockWaiter();
-static int unlockWaiter();
+static int waitForWakeup(double timeout);
 
 
 /* file-global variables */
 
 static jack_port_t**	ports;
 static jack_client_t*	jackClient;
+static int				jackStarted = 0;
 
-static int				rate;
-static int				newRate;
-static int				periodSize;
-static int				newPeriodSize;
+/* Xruns of the jack server, counted by its callback and reported by the main thread */
+static int				xruns = 0;
+static int				reportedXruns = 0;
 
-static char*			sourceName;
 static int				nChannels;
 static char**			channelNames;
 
-static pa_simple*		pulseStream;
-
-static float*			pulseBuffer;
-static int				pulsePeriodSize;
-static int				pulseMaxPeriods;
-static int				pulseMaxPeriodSize;
-
-static int				pulseBufferFrames;
-static int				pulseBufferOffset;
-static int				pulseMissedPeriods;
-
-static double			pulseMaxBufferTime;
-
-/* bufferUnderrunSide
-	-1: no buffer underrun.
-	0: jack buffer underrun.
-	1: pulse buffer underrun.
-*/
-static int				bufferUnderrunSide;
-
-/* benchmarkStatus
-	-1: no benchmark started.
-	0: benchmark running, without detecting extra latency.
-	1: benchmark running and detecting extra latency.
-	2: benchmark finished.
-	3: benchmark approved to not be restart again.
-*/
-static int				benchmarkStatus = -1;
-
-static int				bufferUnderrunAmount;
-static double			bufferUnderrunLastTime;
-static double			bufferUnderrunTotalTime;
-
-static double			maxBufferUnderrunTimeInterval;
-
-static int				benchmarkMinPeriods;
-static int				benchmarkMaxPeriods;
-
-static int				benchmarkPeriodCounter;
-static int				benchmarkTotalPeriodCounter;
-static int				benchmarkCountTo;
-static int				benchmarkMaxMissedPeriods;
-
-/* state
-	-2: both sides not initialized yet.
-	-1: process not initialized yet.
-	0: everything initialized, but no signals of both sides received yet.
-	1: received signal of jack but not of pulse in this state.
-	2: received signal of pulse while in state 1, this is either the benchmarking state or the common operating state.
-	In this way, with this 'handshake', we try to start syncronised.
-*/
-static int				state = -2;
-
-/* todo
-	-1: just proceed through the functions and callbacks as normal.
-	0: soft-restart the process, by skipping benchmarking.
-	1: restart the process.
-	2: stop the process and quit.
-*/
-static int				todo = -1;
-static pthread_mutex_t	todoMutex = PTHREAD_MUTEX_INITIALIZER;
-
-static pthread_mutex_t	bufferMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t	pulseMutex = PTHREAD_MUTEX_INITIALIZER;
+/* The pipe, see 'p2jaudio.h' */
+static p2jaudio_options	options;
+static p2jaudio_pipe*	audioPipe;
+
+/* Whether commands are read from stdin */
+static int				useCommands = 0;
+
+/* Startup: jack connects before 'startupDeadline', while the pipe connects to pulse */
+static double			launchTime;
+static double			startupDeadline;
+static pthread_mutex_t	connectMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	connectCond = PTHREAD_COND_INITIALIZER;
 
 
 /* working together to stop CTS */
@@ -176,13 +99,6 @@ typedef jack_default_audio_sample_t jack_sample_t;
 
 
 
-int imin(int a, int b) {
-	return a < b ? a : b;
-}
-int imax(int a, int b) {
-	return a > b ? a : b;
-}
-
 double getTime() {
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
@@ -193,37 +109,114 @@ double getTime() {
 
 static int samplerateChange(jack_nframes_t r, void* arg)
 {
-	if (newRate != r) {
-		newRate = r;
-		printf ("Rate changed to %d.\n", r);
-		return restartProcess();
-	}
+	p2jaudio_pipe_setRate(audioPipe, r);
 	return 0;
 }
 
 static int periodSizeChange(jack_nframes_t b, void* arg)
 {
-	if (newPeriodSize != b) {
-		newPeriodSize = b;
-		printf ("Period Size changed to %d.\n", b);
-		return restartProcess();
-	}
+	p2jaudio_pipe_setPeriodSize(audioPipe, b);
+	return 0;
+}
+
+static int xrunOccurred(void* arg)
+{
+	// This may be called from the realtime thread of jack, so no printf here
+	__atomic_add_fetch(&xruns, 1, __ATOMIC_RELAXED);
 	return 0;
 }
 
+static void reportXruns()
+{
+	const int n = __atomic_load_n(&xruns, __ATOMIC_RELAXED);
+	if (n != reportedXruns) {
+		printf ("Jack xruns: %d.\n", n);
+		reportedXruns = n;
+	}
+}
+
+
+
+/* Waits on 'connectCond' until '*status' is no longer 0, returns -1 when 'startupDeadline' passed */
+static int waitForConnect(int* status) {
+	struct timespec deadline;
+	deadline.tv_sec = (time_t)startupDeadline;
+	deadline.tv_nsec = (long)((startupDeadline - deadline.tv_sec) * 1000000000);
+	
+	int ret = 0;
+	pthread_mutex_lock(&connectMutex);
+	while (*status == 0 && ret == 0)
+		if (pthread_cond_timedwait(&connectCond, &connectMutex, &deadline) == ETIMEDOUT)
+			ret = -1;
+	if (*status != 0)
+		ret = 0;
+	pthread_mutex_unlock(&connectMutex);
+	return ret;
+}
+
+/* jackConnectStatus: 0 while connecting, 1 connected, -1 failed, -2 abandoned by jack_start() after the deadline */
+static jack_client_t*	jackConnectClient;
+static int				jackConnectStatus;
+
+/* Owns its argument, the name of the client, since jack_start() may give up on it before it returns */
+static void* jack_connectRun(void* arg)
+{
+	jack_client_t* client = jack_client_open((char*)arg, JackNullOption, NULL);
+	free(arg);
+	
+	pthread_mutex_lock(&connectMutex);
+	const int abandoned = (jackConnectStatus == -2);
+	if (!abandoned) {
+		jackConnectClient = client;
+		jackConnectStatus = (client != NULL ? 1 : -1);
+		pthread_cond_broadcast(&connectCond);
+	}
+	pthread_mutex_unlock(&connectMutex);
+	
+	if (abandoned && client != NULL)
+		jack_client_close(client);
+	return NULL;
+}
 
 static int jack_start(char* sourceName, int nChannels, char** channelNames)
 {
 	printf ("Starting Jack...\n");
 	
-	if (state > -2) {
+	if (jackStarted) {
 		printf ("Jack already started.\n");
 		return 0;
 	}
 
+	// Open the client in a separate thread, since it may hang (e.g. while starting the jack server)
+	
 	char* instancename = strdup(sourceName);
-	if ((jackClient = jack_client_open(instancename, JackNullOption, NULL)) == 0) {
-		printf ("Failed to open new jack client: %s\n", instancename);
+	if (instancename == NULL) {
+		printf ("Failed to allocate the name of the jack client.\n");
+		return -1;
+	}
+	pthread_t jackConnectThread;
+	jackConnectStatus = 0;
+	if (pthread_create(&jackConnectThread, NULL, jack_connectRun, instancename) != 0) {
+		printf ("Failed to create jack connection thread.\n");
+		free(instancename);
+		return -1;
+	}
+	pthread_detach(jackConnectThread);
+	
+	if (waitForConnect(&jackConnectStatus) == -1) {
+		// Abandon the connection, the thread closes the client if it still opens one
+		pthread_mutex_lock(&connectMutex);
+		const int abandoned = (jackConnectStatus == 0);
+		if (abandoned)
+			jackConnectStatus = -2;
+		pthread_mutex_unlock(&connectMutex);
+		if (abandoned) {
+			printf ("Jack did not start within %fs.\n", options.timeout);
+			return -1;
+		}
+	}
+	if ((jackClient = jackConnectClient) == 0) {
+		printf ("Failed to open new jack client: %s\n", sourceName);
 		return -1;
 	}
 
@@ -243,11 +236,9 @@ static int jack_start(char* sourceName, int nChannels, char** channelNames)
 					JackPortIsOutput, 0);
 	}
 
-	rate = newRate = jack_get_sample_rate(jackClient);
 	jack_set_sample_rate_callback(jackClient, samplerateChange, 0);
-
-	periodSize = newPeriodSize = jack_get_buffer_size(jackClient);
 	jack_set_buffer_size_callback(jackClient, periodSizeChange, 0);
+	jack_set_xrun_callback(jackClient, xrunOccurred, 0);
 
 	if (jack_activate(jackClient) != 0) {
 		printf ("Failed to activate jack client.\n");
@@ -255,107 +246,32 @@ static int jack_start(char* sourceName, int nChannels, char** channelNames)
 		return -1;
 	}
 
-	// Change state
-	
-	state = -1;
+	jackStarted = 1;
 	printf ("Jack started.\n");
 	
-	return 0;
+	// The pipe outputs silence until it is started
+	
+	return p2jaudio_pipe_start(audioPipe, jack_get_sample_rate(jackClient), jack_get_buffer_size(jackClient));
 }
 
+/* Pulls the frames of the pipe straight into the port buffers */
 static int jack_process(jack_nframes_t frames, void* arg)
 {
-	pthread_mutex_lock(&todoMutex);
-	if (todo > -1) {
-		pthread_mutex_unlock(&todoMutex);
-		return 0;
-	}
-	pthread_mutex_unlock(&todoMutex);
-	
-	pthread_mutex_lock(&bufferMutex);
-	
-	if (state == 0) {
-		#if (DEBUG==1)
-		printf ("Jack process: state increased to 1.\n");
-		#endif
-		state = 1;
-	}
-	
-	if (state < 2) {
-		pthread_mutex_unlock(&bufferMutex);
-		return 0;
-	}
-	
-	if (nChannels * frames != pulsePeriodSize) {
-		#if (DEBUG==1)
-		printf ("Failed assertion: (nChannels * frames = %d) != (pulsePeriodSize = %d)\n", nChannels * frames, pulsePeriodSize);
-		#endif
-		pthread_mutex_unlock(&bufferMutex);
-		stop();
-		return 0;
-	}
-	
-	pulseMissedPeriods++;
-	
-	if (USE_BENCHMARK && benchmarkStatus < 3) {
-		if (benchmarkStatus < 2)
-			benchmarkStatus = imax(updateBenchmarkVariables(0), benchmarkStatus);
-	
-	} else {
-		const int underrunStatus = updateUnderrunVariables(0);
-		if (underrunStatus == -2) {
-			pthread_mutex_unlock(&bufferMutex);
-			stop();
-			return 0;
-		}
-		
-		int bufferIdx;
-		if (pulseBufferFrames == 0) {
-			bufferIdx = (pulseMaxPeriodSize + pulseBufferOffset - pulsePeriodSize) % pulseMaxPeriodSize;
-		} else {
-			bufferIdx = pulseBufferOffset;
-			pulseBufferFrames -= pulsePeriodSize;
-			pulseBufferOffset = (pulseBufferOffset + pulsePeriodSize) % pulseMaxPeriodSize;
-			#if (DEBUG==1)
-			printf ("Reading buffer and shifting pulseBufferOffset to %d, then pulseBufferFrames = %d.\n", pulseBufferOffset, pulseBufferFrames);
-			#endif
-		}
+	jack_sample_t* chnls[nChannels];
+	int i;
+	for (i = 0; i < nChannels; i++)
+		chnls[i] = (jack_sample_t*) jack_port_get_buffer(ports[i], frames);
 	
-		if (pulseBufferOffset + pulsePeriodSize > pulseMaxPeriodSize) {
-			#if (DEBUG==1)
-			printf ("Failed assertion: (pulseBufferOffset + pulsePeriodSize = %d) > (pulseMaxPeriodSize = %d)\n", pulseBufferOffset + pulsePeriodSize, pulseMaxPeriodSize);
-			#endif
-			pthread_mutex_unlock(&bufferMutex);
-			stop();
-			return 0;
-		}
-		
-		#if (DEBUG==1)
-		printf ("Jack Process.\n");
-		#endif
-		
-		jack_sample_t* chnls[nChannels];
-		int i;
-		for (i = 0; i < nChannels; i++)
-			chnls[i] = (jack_sample_t*) jack_port_get_buffer(ports[i], frames);
-		
-		int j;
-		for (j = 0; j < frames; j++)
-			for (i = 0; i < nChannels; i++) {
-				chnls[i][j] = pulseBuffer[bufferIdx];
-				bufferIdx++;
-			}
-	}
-
-	pthread_mutex_unlock(&bufferMutex);
+	p2jaudio_pipe_process(audioPipe, chnls, frames);
 	return 0;
 }
 
+
 static int jack_stop()
 {
 	printf ("Stopping Jack...\n");
 	
-	if (state <= -2) {
+	if (!jackStarted) {
 		printf ("Jack already stopped.\n");
 		return 0;
 	}
@@ -364,9 +280,7 @@ static int jack_stop()
 	jack_client_close(jackClient);
 	free(ports);
 	
-	// Change state
-	
-	state = -2;
+	jackStarted = 0;
 	printf ("Jack stopped.\n");
 	
 	return 0;
@@ -374,531 +288,136 @@ static int jack_stop()
 
 static void jack_shutdown(void* arg)
 {
-	stop();
+	p2jaudio_pipe_stop(audioPipe);
 }
 
 
+static sem_t waiterSem;
+static volatile sig_atomic_t stopRequested = 0;
+static volatile sig_atomic_t dumpRequested = 0;
+
 static void intHandler(int sig)
 {
-	stop();
+	// Only async-signal-safe calls here, the main thread stops the pipe
+	stopRequested = 1;
+	sem_post(&waiterSem);
+}
+static void dumpHandler(int sig)
+{
+	dumpRequested = 1;
+	sem_post(&waiterSem);
 }
 static void setupInterrupts()
 {
 	signal(SIGINT, intHandler);
 	signal(SIGTERM, intHandler);
 	signal(SIGKILL, intHandler);
+	signal(SIGUSR1, dumpHandler);
 }
 
-static pthread_t pulseServerThread;
-static pthread_mutex_t pulseServerMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t pulseServerMutex2 = PTHREAD_MUTEX_INITIALIZER;
-static int pulseRunning = -1;
-static int (*pulseServer_processCb)();
-static void pulseServer_setProcessCallback(int (*cb)()) {
-	pulseServer_processCb = cb;
-}
-static void pulseServer_start()
-{
-	pthread_mutex_lock(&pulseServerMutex);
-	
-	for (;;) {
-		if (pulseRunning == 1)
-			break;
-		
-		if (pulseRunning == 0) {
-			pthread_mutex_lock(&pulseServerMutex2);
-			pthread_mutex_unlock(&pulseServerMutex);
-			pthread_join(pulseServerThread, NULL);
-			pthread_mutex_lock(&pulseServerMutex);
-			pthread_mutex_unlock(&pulseServerMutex2);
-		}
-		
-		if (pulseRunning == -1) {
-			pthread_create(&pulseServerThread, NULL, (void*)pulseServer_run, NULL);
-			break;
-		}
-	}
-	
-	pthread_mutex_unlock(&pulseServerMutex);
-}
-static void pulseServer_run()
-{
-	pthread_mutex_lock(&pulseServerMutex);
-	pulseRunning = 1;
-	pthread_mutex_unlock(&pulseServerMutex);
-	
-	printf ("Pulse Server has started.\n");
-	
-	while (pulseRunning) {
-		(*pulseServer_processCb)();
-	}
-	
-	printf ("Pulse Server has ended.\n");
-	
-	pthread_mutex_lock(&pulseServerMutex);
-	pulseRunning = -1;
-	pthread_mutex_unlock(&pulseServerMutex);
-}
-static void pulseServer_stop()
-{
-	pthread_mutex_lock(&pulseServerMutex);
-	pulseRunning = 0;
-	pthread_mutex_unlock(&pulseServerMutex);
-}
-
-static int pulse_start(char* sourceName, int rate, int nChannels)
-{
-	pthread_mutex_lock(&pulseMutex);
-	printf ("Starting Pulse (%d*%dHz)...\n", nChannels, rate);
-	
-	if (state != -1) {
-		#if (DEBUG==1)
-		printf ("Pulse start: (state = %d) != -1.\n", state);
-		#endif
-		pthread_mutex_unlock(&pulseMutex);
-		return -1;
-	}
-	
-	/* The sample type to use */
-	const pa_sample_spec ss = {
-		.format = PA_SAMPLE_FLOAT32LE,
-		.rate = rate,
-		.channels = nChannels
-	};
-
-	/* Create the recording stream */
-	int error;
-	if (!(pulseStream = pa_simple_new(NULL, sourceName, PA_STREAM_RECORD, NULL, "record", &ss, NULL, NULL, &error))) {
-		fprintf(stderr, __FILE__": pa_simple_new() failed: %s\n", pa_strerror(error));
-		pthread_mutex_unlock(&pulseMutex);
-		return -1;
-	}
-	
-	pulseServer_setProcessCallback(pulse_process);
-	pulseServer_start();
-	printf ("Pulse started.\n");
-	
-	pthread_mutex_unlock(&pulseMutex);
-	return 0;
-}
 
-static int pulse_process()
+/* Reads commands from stdin (see '-i'), one per line:
+	source NAME: switch to the PulseAudio Source device NAME, without restarting the pipe. */
+static void commands_start()
 {
-	pthread_mutex_lock(&todoMutex);
-	if (todo > -1) {
-		pthread_mutex_unlock(&todoMutex);
-		return 0;
-	}
-	pthread_mutex_unlock(&todoMutex);
-	
-	pthread_mutex_lock(&pulseMutex);
-	
-	if (state < 0) {
-		pthread_mutex_unlock(&pulseMutex);
-		return -1;
-	}
-	
-	float tmpBuffer[pulsePeriodSize];
-
-	/* Record some data ... */
-	int error;
-	if (pa_simple_read(pulseStream, tmpBuffer, sizeof(tmpBuffer), &error) < 0) {
-		fprintf(stderr, __FILE__": pa_simple_read() failed: %s\n", pa_strerror(error));
-		pthread_mutex_unlock(&pulseMutex);
-		stop();
-		return -1;
-	}
-	
-	pthread_mutex_unlock(&pulseMutex);
-	
-	pthread_mutex_lock(&bufferMutex);
-	
-	if (state < 1) {
-		pthread_mutex_unlock(&bufferMutex);
-		return -1;
-	} else if (state == 1) {
-		if (USE_BENCHMARK && benchmarkStatus == -1)
-			initBenchmark();
-		
-		// Change state
-		state = 2;
-		#if (DEBUG==1)
-		printf ("Pulse process: state increased to 2.\n");
-		#endif
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, commands_run, NULL) != 0) {
+		printf ("Failed to create the command thread.\n");
+		return;
 	}
-	
-	pulseMissedPeriods--;
-	
-	if (USE_BENCHMARK && benchmarkStatus < 3) {
-		if (benchmarkStatus < 2)
-			benchmarkStatus = imax(updateBenchmarkVariables(1), benchmarkStatus);
-	
-	} else {
-		const int underrunStatus = updateUnderrunVariables(1);
-		if (underrunStatus == -2) {
-			pthread_mutex_unlock(&bufferMutex);
-			stop();
-			return 0;
-		} else if (underrunStatus == -1)
-			pulseBufferFrames = 0;
-		
-		#if (DEBUG==1)
-		printf ("Pulse Process.\n");
-		#endif
-		
-		const int pulseBufferOffsetAtEnd = (pulseBufferOffset + pulseBufferFrames) % pulseMaxPeriodSize;
-		memcpy(&pulseBuffer[pulseBufferOffsetAtEnd], &tmpBuffer[0], sizeof(tmpBuffer));
-		if (pulseBufferFrames == pulseMaxPeriodSize)
-			pulseBufferOffset = (pulseBufferOffset + pulseBufferFrames) % pulseMaxPeriodSize;
-		else
-			pulseBufferFrames += pulsePeriodSize;
-		#if (DEBUG==1)
-		printf ("Writing to buffer from %d with length %d.\n", pulseBufferOffsetAtEnd, (int)sizeof(tmpBuffer));
-		#endif
-	}
-	
-	pthread_mutex_unlock(&bufferMutex);
-	return 0;
+	pthread_detach(thread);
 }
-
-static int pulse_stop()
+static void* commands_run(void* arg)
 {
-	pthread_mutex_lock(&pulseMutex);
-	printf ("Stopping Pulse...\n");
+	char line[MAX_COMMAND_LENGTH + 8];
 	
-	if (state < -1) {
-		#if (DEBUG==1)
-		printf ("Pulse start: (state = %d) < -1.\n", state);
-		#endif
-		pthread_mutex_unlock(&pulseMutex);
-		return -1;
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, "source ", 7) == 0 && strlen(&line[7]) > 0)
+			p2jaudio_pipe_switchSource(audioPipe, &line[7]);
+		else if (strlen(line) > 0)
+			printf ("Unknown command '%s', the only command is 'source NAME'.\n", line);
 	}
-	
-	pulseServer_stop();
-	
-	if (pulseStream != NULL)
-		pa_simple_free(pulseStream);
-	
-	printf ("Pulse stopped.\n");
-	
-	pthread_mutex_unlock(&pulseMutex);
-	return 0;
-}
-
-
-int timeToPeriods(double time) {
-	return (int)ceil(nChannels * rate * time / pulsePeriodSize);
+	return NULL;
 }
 
-double periodsToTime(int periods) {
-	return periods * pulsePeriodSize / (double)(nChannels * rate);
-}
 
-static int startProcess()
-{
-	printf ("Starting Process (%d*%dHz buffered in %d frames/channel)...\n", nChannels, rate, periodSize);
-	
-	if (state > -1) {
-		printf ("Process already started.\n");
-		return 0;
-	} else if (state < -1) {
-		printf ("Jack not started yet.\n");
-		return -1;
-	}
-	
-	// Update buffer
-	
-	pthread_mutex_lock(&bufferMutex);
 
-	pulsePeriodSize = nChannels * periodSize;
-	
-		pulseMissedPeriods = 0;
-		if (USE_BENCHMARK == 0 || benchmarkStatus >= 2) {
-			if (USE_BENCHMARK == 0)
-				pulseMaxBufferTime = PULSE_MAX_BUFFER_TIME;
-			
-			const int bufferStatus = initBuffer();
-			if (bufferStatus == -1) {
-				pthread_mutex_unlock(&bufferMutex);
-				stop();
-				return -1;
-			}
-			
-			benchmarkStatus = 3;
-		}
-	
-	pthread_mutex_unlock(&bufferMutex);
-	
-	// Start pulse
-	
-	if (pulse_start(sourceName, rate, nChannels) == -1) {
-		stop();
-		return -1;
-	}
-	
-	// Change state
-	
-	state = 0;
-	printf ("Process started.\n");
-	
-	return 0;
-}
-
-static int initBenchmark() {
-	printf ("Benchmark started.\n");
-	
-	benchmarkMinPeriods = timeToPeriods(MIN_BENCHMARK_TIME);
-	benchmarkMaxPeriods = timeToPeriods(MAX_BENCHMARK_TIME);
-	
-	benchmarkPeriodCounter = 0;
-	benchmarkTotalPeriodCounter = 0;
-	benchmarkCountTo = benchmarkMinPeriods;
-	benchmarkMaxMissedPeriods = 0;
-	
-	return 0;
-}
-
-static int updateBenchmarkVariables(int side) {
-	if (benchmarkPeriodCounter >= benchmarkCountTo) {
-		printf ("Benchmark ended: benchmarkMaxMissedPeriods ended with %d => \n\t latency of %fms; I'll use a buffer of %dperiods.\n", benchmarkMaxMissedPeriods, 1000*(periodsToTime(benchmarkMaxMissedPeriods)), imax(1.25 * 2*benchmarkMaxMissedPeriods, 1) + 1);
-		pulseMaxBufferTime = periodsToTime(imax(/* 1.25 * */ 2*benchmarkMaxMissedPeriods, 1) + 1);
-		softrestartProcess();
-		return 2;
-	}
-	
-	const int magnitude = (1 - 2*side) * pulseMissedPeriods;
-	benchmarkPeriodCounter++;
-	
-	if (magnitude > benchmarkMaxMissedPeriods) {
-		benchmarkMaxMissedPeriods = magnitude;
-		benchmarkTotalPeriodCounter += benchmarkPeriodCounter;
-		benchmarkPeriodCounter = 0;
-		benchmarkCountTo = imin(2 * benchmarkMaxMissedPeriods, benchmarkMaxPeriods - benchmarkTotalPeriodCounter);
-		return 1;
-	}
-	
-	return 0;
-}
+static pthread_t interruptThread;
 
-static int initBuffer() {
-	pulseMaxPeriods = imax(timeToPeriods(pulseMaxBufferTime), 1);
-	pulseMaxPeriodSize = pulseMaxPeriods * pulsePeriodSize;
-	#if (DEBUG==1)
-	printf ("pulseMaxPeriodSize set to %d.\n", pulseMaxPeriodSize);
-	#endif
-	
-	if ((pulseBuffer = malloc(sizeof(float) * pulseMaxPeriodSize)) == NULL) {
-		printf ("Failed to allocate new buffer size = %dB.\n", (int)sizeof(float) * pulseMaxPeriodSize);
-		return -1;
+/* The main thread sleeps on a semaphore, since sem_post() may also be called from a signal handler */
+static int waitForWakeup(double timeout) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += (time_t)timeout;
+	deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000);
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
 	}
 	
-	// Init variables
-	
-	pulseBufferFrames = 0;
-	pulseBufferOffset = 0;
-	
-	clearUnderrunVariables();
-	bufferUnderrunLastTime = 0;
-	maxBufferUnderrunTimeInterval = pulseMaxBufferTime * MAX_BUFFER_UNDERRUN_TIME_MULTIPLIER;
-	
+	while (sem_timedwait(&waiterSem, &deadline) == -1)
+		if (errno != EINTR)
+			return -1;
 	return 0;
 }
 
-static void clearUnderrunVariables() {
-	bufferUnderrunSide = -1;
-	bufferUnderrunAmount = 0;
-	bufferUnderrunTotalTime = 0;
-}
 
-static int updateUnderrunVariables(int side) {
-	const int multiplier = 1 - 2*side;
-	const int magnitude = multiplier * pulseMissedPeriods;
-	
-	if ( (magnitude + pulseMaxPeriods / 2 >= 0) && 
-			(bufferUnderrunSide == side) )
-		clearUnderrunVariables();
-	
-	if (magnitude > pulseMaxPeriods) {
-		if (magnitude > 2*pulseMaxPeriods) {
-			#if (DEBUG==1)
-			printf ("%d-side process: Exceeded two times buffersize. => Resetting some stuff.\n", side);
-			#else
-			printf ("Buffer underrun.\n"); // TODO: printf is actually not allowed in a realtime process-thread.
-			#endif
-			pulseMissedPeriods -= multiplier * pulseMaxPeriods;
-			
-			if (bufferUnderrunSide == -1)
-				bufferUnderrunLastTime = getTime();
-			else
-				bufferUnderrunTotalTime += getTime() - bufferUnderrunLastTime;
-			bufferUnderrunSide = 1 - side;
-			bufferUnderrunAmount++;
-			
-			if ( (bufferUnderrunTotalTime / bufferUnderrunAmount <= maxBufferUnderrunTimeInterval) &&
-						(bufferUnderrunAmount >= MIN_BUFFER_UNDERRUN_AMOUNT) ) {
-				#if (DEBUG==1)
-				printf ("%d-side process: Shutting down: Too frequent buffer underruns.\n", side);
-				#else
-				printf ("Shutting down: Too frequent buffer underruns.\n");
-				#endif
-				return -2;
-			} else {
-				#if (DEBUG==1)
-				printf ("%d-side process: Not frequent enough buffer underruns to quit: Interval = %f; Amount = %d.\n", side, bufferUnderrunTotalTime / bufferUnderrunAmount, bufferUnderrunAmount);
-				#endif
-			}
-			
-			return -1;
-		}
-		
-		#if (DEBUG==1)
-		printf ("%d-side process: underrun: pulseMaxBufferTime should be %f.\n", side, periodsToTime(magnitude));
-		#endif
-		return 0;
-	}
+static void printCpuUsage(double startTime) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == -1)
+		return;
 	
-	return 1;
+	const double userTime = usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1000000;
+	const double systemTime = usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1000000;
+	const double wallTime = getTime() - startTime;
+	printf ("CPU usage of this pipe in %s mode: %f%% (%fs user, %fs system in %fs).\n",
+			options.throughput ? "throughput" : "low-latency",
+			100 * (userTime + systemTime) / wallTime, userTime, systemTime, wallTime);
 }
 
-static int stopProcess()
-{
-	printf ("Process stopping...\n");
-	
-	if (state <= -1) {
-		printf ("Process already stopped.\n");
-		return 0;
-	}
-	
-	// Change state
-	
-	const int prevState = state;
-	state = -1;
-	if (todo != 0)
-		benchmarkStatus = -1;
-	
-	pthread_mutex_lock(&bufferMutex);
-	if (prevState == 3) {
-		
-		// Free buffer
-		if (pulseBuffer != NULL)
-			free(pulseBuffer);
-	
-	}
-	pthread_mutex_unlock(&bufferMutex);
-	
-	// Stop pulse
-	
-	pulse_stop();
-	printf ("Process stopped.\n");
+int run(char* srcName, int nChnls, char** chlNames) {
+	const double startTime = getTime();
 	
-	return 0;
-}
-
-
-static int changeTodo(int newTodo) {
-	pthread_mutex_lock(&todoMutex);
-	todo = imax(newTodo, todo);
-	#if (DEBUG==1)
-	printf ("todo change: %d.\n", todo);
-	#endif
-	pthread_mutex_unlock(&todoMutex);
-	unlockWaiter();
-	return 0;
-}
-
-static int softrestartProcess() {
-	return changeTodo(0);
-}
-
-int restartProcess() {
-	return changeTodo(1);
-}
-
-int start(char* srcName, int nChnls, char** chlNames)
-{
-	sourceName = srcName;
-	nChannels = nChnls;
+	options.name = srcName;
+	options.nChannels = nChannels = nChnls;
 	channelNames = chlNames;
 	
-	int ret = jack_start(sourceName, nChannels, channelNames);
-	if (ret == 0)
-		ret = startProcess();
-	return ret;
-}
-
-int stop()
-{
-	return changeTodo(2);
-}
-
-
-static pthread_t interruptThread;
-
-static int waitUnlocked = 1;
-static pthread_mutex_t	waitMutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t	waitUnlockMutex = PTHREAD_MUTEX_INITIALIZER;
-static int lockWaiter() {
-	pthread_mutex_lock(&waitMutex);
-	pthread_mutex_lock(&waitUnlockMutex);
-	waitUnlocked = 0;
-	pthread_mutex_unlock(&waitUnlockMutex);
-	return 0;
-}
-static int unlockWaiter() {
-	int ret;
-	pthread_mutex_lock(&waitUnlockMutex);
-	if (waitUnlocked == 0) {
-		pthread_mutex_unlock(&waitMutex);
-		waitUnlocked = 1;
-	} else
-		ret = -1;
-	pthread_mutex_unlock(&waitUnlockMutex);
-	return ret;
-}
-
-int run(char* srcName, int nChnls, char** chlNames) {
+	sem_init(&waiterSem, 0, 0);
 	pthread_create(&interruptThread, NULL, (void*)setupInterrupts, NULL);
 	pthread_join(interruptThread, NULL);
 	
-	int ret = start(srcName, nChnls, chlNames);
+	// The pipe connects to pulse while jack starts
+	
+	if ((audioPipe = p2jaudio_pipe_new(&options)) == NULL)
+		return -1;
+	
+	startupDeadline = launchTime + options.timeout;
+	int ret = jack_start(srcName, nChannels, channelNames);
 	if (ret == -1)
-		stop();
+		p2jaudio_pipe_stop(audioPipe);
+	else if (useCommands)
+		commands_start();
 	
-	for (;;) {
-		lockWaiter();
-// 		usleep(20000);
-
-		pthread_mutex_lock(&todoMutex);
-		if (todo > -1) {
-			pthread_mutex_unlock(&todoMutex);
-			stopProcess();
-			pthread_mutex_lock(&todoMutex);
-		}
-		if (todo == 0 || todo == 1) {
-			#if (DEBUG==1)
-			printf ("Got restart type %d.\n", todo);
-			#endif
-			todo = -1;
-			pthread_mutex_unlock(&todoMutex);
-			rate = newRate;
-			periodSize = newPeriodSize;
-			printf ("Restarting Process...\n");
-			if ((ret = startProcess()) == -1)
-				stop();
-			else
-				printf ("Process restarted.\n");
-		} else if (todo == 2) {
-			#if (DEBUG==1)
-			printf ("Got stop.\n");
-			#endif
-			pthread_mutex_unlock(&todoMutex);
-			jack_stop();
-			break;
+	while (p2jaudio_pipe_isRunning(audioPipe)) {
+		waitForWakeup(WAIT_INTERVAL);
+		
+		if (stopRequested)
+			p2jaudio_pipe_stop(audioPipe);
+		
+		if (dumpRequested) {
+			dumpRequested = 0;
+			p2jaudio_pipe_dump(audioPipe);
 		}
-		pthread_mutex_unlock(&todoMutex);
+		
+		reportXruns();
 	}
 	
-	unlockWaiter();
+	jack_stop();
+	printCpuUsage(startTime);
+	p2jaudio_pipe_free(audioPipe);
+	
+	sem_destroy(&waiterSem);
 	
 	return ret;
 }
@@ -910,20 +429,37 @@ static int processCmdArguments(int argc, char **argv) {
 	int doesUserNeedHelp = 0;
 	
 	strcpy(srcName, "");
+	p2jaudio_options_init(&options);
 	
 	static struct option long_options[] = {
 		{"help",     no_argument,       0, 'h'},
 		{"name",     required_argument, 0, 'n'},
 		{"channels", required_argument, 0, 'c'},
+		{"latency",  required_argument, 0, 'l'},
+		{"read-size", required_argument, 0, 'r'},
+		{"shm",      no_argument,       0, 's'},
+		{"throughput", no_argument,     0, 't'},
+		{"timeout",  required_argument, 0, 'T'},
+		{"preroll",  required_argument, 0, 'P'},
+		{"preroll-file", required_argument, 0, 'F'},
+		{"dump",     required_argument, 0, 'D'},
+		{"capture-rate", required_argument, 0, 'R'},
+		{"resample-quality", required_argument, 0, 'q'},
+		{"trace",    required_argument, 0, 'X'},
+		{"commands", no_argument,       0, 'i'},
 		{0, 0, 0, 0}
 	};
 	int c, option_index;
 	
 	while (c != -1) {
-		c = getopt_long(argc, argv, "c:hn:", long_options, &option_index);
+		c = getopt_long(argc, argv, "c:hil:n:q:r:stD:F:P:R:T:X:", long_options, &option_index);
 		switch (c) {
 			case 'n':
-				strcpy(srcName, optarg);
+				if (strlen(optarg) >= sizeof(srcName) - strlen(" (p2jaudio)")) {
+					printf ("NAME is too long.\n");
+					doesUserNeedHelp = 1;
+				} else
+					strcpy(srcName, optarg);
 				break;
 	
 			case 'c':
@@ -934,6 +470,82 @@ static int processCmdArguments(int argc, char **argv) {
 				}
 				break;
 			
+			case 'l':
+				options.latencyFrames = atoi(optarg);
+				if (options.latencyFrames <= 0) {
+					printf ("LATENCY must be a number greater than zero.\n");
+					doesUserNeedHelp = 1;
+				}
+				break;
+			
+			case 'r':
+				options.readFrames = atoi(optarg);
+				if (options.readFrames <= 0) {
+					printf ("READ_SIZE must be a number greater than zero.\n");
+					doesUserNeedHelp = 1;
+				}
+				break;
+			
+			case 's':
+				options.shm = 1;
+				break;
+			
+			case 't':
+				options.throughput = 1;
+				break;
+			
+			case 'P':
+				options.prerollTime = atof(optarg);
+				if (options.prerollTime < P2JAUDIO_MIN_PREROLL_TIME) {
+					printf ("PREROLL must be at least %f seconds.\n", P2JAUDIO_MIN_PREROLL_TIME);
+					doesUserNeedHelp = 1;
+				}
+				break;
+			
+			case 'F':
+				options.prerollFile = optarg;
+				break;
+			
+			case 'D':
+				options.prerollDumpTime = atof(optarg);
+				if (options.prerollDumpTime <= 0) {
+					printf ("DUMP must be a number greater than zero.\n");
+					doesUserNeedHelp = 1;
+				}
+				break;
+			
+			case 'R':
+				if (strcmp(optarg, "native") == 0)
+					options.captureRate = -1;
+				else if ((options.captureRate = atoi(optarg)) <= 0) {
+					printf ("CAPTURE_RATE must be a number greater than zero, or 'native'.\n");
+					doesUserNeedHelp = 1;
+				}
+				break;
+			
+			case 'q':
+				if ((options.resampleQuality = p2jaudio_resample_parseQuality(optarg)) == -1) {
+					printf ("QUALITY must be 'low', 'medium', 'high' or 'best'.\n");
+					doesUserNeedHelp = 1;
+				}
+				break;
+			
+			case 'i':
+				useCommands = 1;
+				break;
+			
+			case 'X':
+				options.traceFile = optarg;
+				break;
+			
+			case 'T':
+				options.timeout = atof(optarg);
+				if (options.timeout <= 0) {
+					printf ("TIMEOUT must be a number greater than zero.\n");
+					doesUserNeedHelp = 1;
+				}
+				break;
+			
 			case -1:
 				break;
 			
@@ -952,7 +564,8 @@ static int processCmdArguments(int argc, char **argv) {
 	if (doesUserNeedHelp) {
 		printf (
 "\
-Usage: \t %s [-n NAME] [-c NUM_CHANNELS] \n\
+Usage: \t %s [-n NAME] [-c NUM_CHANNELS] [-l LATENCY] [-r READ_SIZE] [-s] [-t] [-T TIMEOUT] \n\
+\t\t [-R CAPTURE_RATE [-q QUALITY]] [-P PREROLL [-F PREROLL_FILE] [-D DUMP]] [-X TRACE_FILE] [-i] \n\
 \n\
 p2jaudio v0.01-alpha. \n\
 Makes a pipe from a PulseAudio Source device to \n\
@@ -961,6 +574,22 @@ NUM_CHANNELS Jack Output ports and gives it the name NAME. \n\
 Options: \n\
 \t -n, --name=NAME              specify the name of the pipe, to be used as jack and pulse client-name \n\
 \t -c, --channels=NUM_CHANNELS  specify the amount (> 0) of audio channels, to be used from the PulseAudio Source device \n\
+\t -l, --latency=LATENCY        specify the maximum buffered latency in frames, instead of running the benchmark \n\
+\t -r, --read-size=READ_SIZE    specify the amount of frames read from PulseAudio at once (default: the jack period size) \n\
+\t -s, --shm                    publish the buffer in the shared memory segment '/p2jaudio.NAME', see 'p2jaudio_shm.h' \n\
+\t -t, --throughput             read from PulseAudio in batches of 40ms, which uses less CPU but adds latency \n\
+\t -T, --timeout=TIMEOUT        specify the time in seconds jack and pulse may take to connect (default: 10) \n\
+\t -R, --capture-rate=CAPTURE_RATE  capture from PulseAudio at CAPTURE_RATE Hz, or at the rate of the source \n\
+\t                              with 'native', and resample it to the jack rate in p2jaudio (default: the jack rate) \n\
+\t -q, --resample-quality=QUALITY  specify the quality of that resampling: 'low', 'medium', 'high' or 'best', \n\
+\t                              each level doubles the length of the filter (default: high) \n\
+\t -P, --preroll=PREROLL        keep the last PREROLL (>= 2) seconds of audio in a memory-mapped file, \n\
+\t                              which is dumped to a WAV file in the current directory on SIGUSR1 \n\
+\t -F, --preroll-file=PREROLL_FILE  specify the memory-mapped file (default: /var/tmp/p2jaudio.NAME.preroll) \n\
+\t -D, --dump=DUMP              specify how many seconds to dump on SIGUSR1 (default: all of the pre-roll) \n\
+\t -X, --trace=TRACE_FILE       record every callback to the binary TRACE_FILE, to be replayed with 'tools/p2jreplay' \n\
+\t -i, --commands               read commands from stdin, one per line: 'source NAME' switches to the \n\
+\t                              PulseAudio Source device NAME, crossfading, without restarting the pipe \n\
 \t -h, --help                   prints this help-message \n\
 Read the README for more help on this program. \n\
 ", 
@@ -1005,6 +634,8 @@ Read the README for more help on this program. \n\
 
 
 int main(int argc, char **argv) {
+	launchTime = getTime();
+	
 	if (processCmdArguments(argc, argv) == 0)
 		return run(srcName, nChnls, chlNames);
 	else
@@ -1016,3 +647,4 @@ int main(int argc, char **argv) {
 // 	char* chlNames[2] = {"left", "right"};
 // 	return run("p2jaudio", 2, chlNames);
 }
+
@@ -0,0 +1,93 @@
+/**
+
+Name: p2jaudio.h
+Description: Interface of libp2jaudio, which pipes the audio of a PulseAudio Source device
+into an application that has its own jack client (or another realtime audio callback).
+The application pulls the frames of the pipe into its own buffers, from its own process callback,
+so the pipe doesn't need a jack client of its own: no extra node in the jack graph,
+and no extra context switch per period.
+The 'p2jaudio' program is a frontend to it, that gives the pipe a jack client with output ports.
+
+Usage:
+	p2jaudio_options options;
+	p2jaudio_options_init(&options);
+	options.name = "usb mic";
+	p2jaudio_pipe* pipe = p2jaudio_pipe_new(&options);	// connects to pulse, in the background
+	...open the jack client, then once its rate and period size are known:
+	p2jaudio_pipe_start(pipe, rate, periodSize);
+	...in the process callback:				p2jaudio_pipe_process(pipe, buffers, frames);
+	...in the sample rate callback:			p2jaudio_pipe_setRate(pipe, rate);
+	...in the buffer size callback:			p2jaudio_pipe_setPeriodSize(pipe, periodSize);
+	...after the last process callback:		p2jaudio_pipe_free(pipe);
+
+A process can hold any number of pipes, each with its own threads.
+The pipe prints its progress (benchmark, underruns, ...) on stdout, like the 'p2jaudio' program does.
+Link with: -lp2jaudio -lm -lpthread -lrt -lpulse -lpulse-simple
+
+**/
+
+#ifndef P2JAUDIO_H
+#define P2JAUDIO_H
+
+#include "p2jaudio_resample.h"
+
+
+/* Minimum length of the pre-roll, in seconds */
+#define P2JAUDIO_MIN_PREROLL_TIME 2.0
+
+typedef struct p2jaudio_pipe p2jaudio_pipe;
+
+/* Settings of a pipe, the options of the 'p2jaudio' program (see 'p2jaudio -h') */
+typedef struct p2jaudio_options {
+	const char*	name;				/* of the pipe, used as pulse client name, and in the names of its files */
+	const char*	device;				/* PulseAudio Source device, NULL: $PULSE_SOURCE or the default source */
+	int			nChannels;
+	int			latencyFrames;		/* maximum buffered latency, 0: calibrated by the benchmark */
+	int			readFrames;			/* frames read from pulse at once, 0: the period size */
+	int			throughput;			/* read from pulse in batches of 40ms, instead of per period */
+	int			captureRate;		/* rate pulse is captured at, 0: the rate of the pipe, -1: the native rate of the source */
+	int			resampleQuality;	/* P2JAUDIO_RESAMPLE_*, when the capture rate differs */
+	int			shm;				/* publish the buffer in shared memory, see 'p2jaudio_shm.h' */
+	double		prerollTime;		/* seconds of audio kept in a memory-mapped file, 0: none */
+	double		prerollDumpTime;	/* seconds dumped by p2jaudio_pipe_dump(), 0: all of the pre-roll */
+	const char*	prerollFile;		/* NULL: '/var/tmp/p2jaudio.NAME.preroll' */
+	const char*	traceFile;			/* binary trace of the callbacks, see 'p2jaudio_trace.h', NULL: none */
+	double		timeout;			/* seconds pulse may take to connect */
+} p2jaudio_options;
+
+/* Sets the defaults: 2 channels, the default source, calibrated latency */
+void p2jaudio_options_init(p2jaudio_options* options);
+
+/* Creates the pipe and starts connecting to pulse, assuming 48000Hz and periods of 1024 frames.
+   Returns NULL on failure. */
+p2jaudio_pipe* p2jaudio_pipe_new(const p2jaudio_options* options);
+
+/* Starts the pipe at the rate and period size of the application, returns -1 on failure */
+int p2jaudio_pipe_start(p2jaudio_pipe* pipe, int rate, int periodSize);
+
+/* Fills 'buffers' (one per channel) with the next 'frames' frames, which have to be one period,
+   from the process callback of the application. Outputs silence while the pipe isn't running.
+   Returns 1 when frames of the pipe were output, 0 on silence. */
+int p2jaudio_pipe_process(p2jaudio_pipe* pipe, float** buffers, int frames);
+
+/* Restart the pipe at another rate or period size, e.g. from the callbacks of jack */
+void p2jaudio_pipe_setRate(p2jaudio_pipe* pipe, int rate);
+void p2jaudio_pipe_setPeriodSize(p2jaudio_pipe* pipe, int periodSize);
+
+/* Switches to another PulseAudio Source device, crossfading, without restarting the pipe.
+   Moves of the stream made outside of the pipe (e.g. with pavucontrol) are not noticed. */
+void p2jaudio_pipe_switchSource(p2jaudio_pipe* pipe, const char* device);
+
+/* Dumps the pre-roll to a WAV file in the current directory, in the background */
+void p2jaudio_pipe_dump(p2jaudio_pipe* pipe);
+
+/* Stops the pipe, in the background, it also stops by itself on too frequent buffer underruns */
+void p2jaudio_pipe_stop(p2jaudio_pipe* pipe);
+
+/* Returns 0 once the pipe has stopped */
+int p2jaudio_pipe_isRunning(p2jaudio_pipe* pipe);
+
+/* Stops the pipe and frees it, p2jaudio_pipe_process() may not be called anymore */
+void p2jaudio_pipe_free(p2jaudio_pipe* pipe);
+
+#endif
@@ -0,0 +1,378 @@
+/**
+
+Name: p2jaudio_control.h
+Description: The latency control of the buffer: the benchmark that calibrates its latency,
+the detection of buffer underruns, and what jack does with the samples above the latency.
+It only counts frames, the samples themselves stay in the ring (see 'p2jaudio_ring.h'),
+and takes the time as an argument, so 'tools/p2jreplay' can run exactly the same logic
+on a trace recorded with 'p2jaudio -X' (see 'p2jaudio_trace.h').
+It belongs to jack (the reader of the ring): pulse only publishes how many frames it wrote,
+and jack catches up on them every period, so the control is never written by pulse.
+Since jack runs it in its realtime thread, it doesn't print: what the user is told is collected in its message,
+which the caller hands to another thread to print (see p2jaudio_control_printMessage()).
+
+**/
+
+#ifndef P2JAUDIO_CONTROL_H
+#define P2JAUDIO_CONTROL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "p2jaudio_ring.h"
+#include "p2jaudio_probes.h"
+
+
+/* Maximum part of a period dropped per period, when reducing the latency of the buffer */
+#define MAX_DROP_FRACTION 0.25
+/* Frames are only dropped once the buffer held more than its latency for this long,
+   and then only as many as it held more all that time, so jitter of the fill doesn't cause drops */
+#define DROP_DELAY_TIME 0.25
+
+#define MAX_BUFFER_UNDERRUN_TIME_MULTIPLIER 2.0
+#define MIN_BUFFER_UNDERRUN_AMOUNT 5
+
+#define MIN_BENCHMARK_TIME 0.5
+#define MAX_BENCHMARK_TIME 4.0
+
+/* decisions, as returned by p2jaudio_control_jack(), the ones of pulse are recorded in the trace by pulse */
+#define P2JAUDIO_DECISION_LATE			0x01	/* more than the latency behind */
+#define P2JAUDIO_DECISION_RESET			0x02	/* buffer underrun: the buffer was emptied and refilled */
+#define P2JAUDIO_DECISION_SHUTDOWN		0x04	/* too frequent buffer underruns */
+#define P2JAUDIO_DECISION_CALIBRATED	0x08	/* the benchmark ended and set the latency */
+#define P2JAUDIO_DECISION_SILENCE		0x10	/* jack: output silence, the buffer isn't filled up yet */
+#define P2JAUDIO_DECISION_DROP			0x20	/* jack: dropped frames above the latency */
+#define P2JAUDIO_DECISION_STARVED		0x40	/* jack: less than a period buffered, so it was repeated */
+#define P2JAUDIO_DECISION_OVERFLOW		0x80	/* pulse: the ring was full, samples of the read were dropped */
+#define P2JAUDIO_DECISION_SWITCHED		0x100	/* pulse: switched to another source, the benchmark restarts */
+
+/* events of a message */
+#define P2JAUDIO_MESSAGE_BENCHMARK_STARTED	0x01
+#define P2JAUDIO_MESSAGE_BENCHMARK_ENDED	0x02
+#define P2JAUDIO_MESSAGE_UNDERRUN			0x04
+#define P2JAUDIO_MESSAGE_SHUTDOWN			0x08
+
+
+/* What the user is told about one or more periods */
+typedef struct p2jaudio_control_message {
+	int		events;
+	int		underruns;
+	/* Of the benchmark that ended */
+	int		benchmarkMaxMissedFrames;
+	int		maxFrames;
+	double	maxBufferTime;
+} p2jaudio_control_message;
+
+
+typedef struct p2jaudio_control {
+	int		rate;
+	int		nChannels;
+	int		periodSize;
+	int		readFrames;		/* maximum frames written by one pulse read */
+	int		bufferFrames;	/* size of the ring */
+
+	/* Latency of the buffer, including its room for a pulse read and a jack period, jack drops the frames above it */
+	int		maxFrames;
+	double	maxBufferTime;
+
+	/* Whether the buffer has been filled up to maxFrames, jack outputs silence until then */
+	int		primed;
+
+	/* Frames read by jack minus frames written by pulse */
+	int		missedFrames;
+
+	/* Fill of the ring in samples, as jack saw it before reading its last period */
+	int		fill;
+
+	/* Frames jack has read since the buffer last held at most its latency, and the least it held more since */
+	int		excessFrames;
+	int		minExcessFrames;
+
+	/* Frames written by pulse, and its switches of source, as far as jack has caught up on them */
+	long long	pulseFrames;
+	int		pulseSwitches;
+
+	/* benchmarkStatus
+		-1: no benchmark started.
+		0: benchmark running, without detecting extra latency.
+		1: benchmark running and detecting extra latency.
+		2: benchmark finished.
+		3: benchmark approved to not be restart again.
+	*/
+	int		benchmarkStatus;
+
+	int		benchmarkMinFrames;
+	int		benchmarkMaxFrames;
+
+	int		benchmarkFrameCounter;
+	int		benchmarkTotalFrameCounter;
+	int		benchmarkCountTo;
+	int		benchmarkMaxMissedFrames;
+
+	/* bufferUnderrunSide
+		-1: no buffer underrun.
+		0: jack buffer underrun.
+		1: pulse buffer underrun.
+	*/
+	int		bufferUnderrunSide;
+
+	int		bufferUnderrunAmount;
+	double	bufferUnderrunLastTime;
+	double	bufferUnderrunTotalTime;
+
+	double	maxBufferUnderrunTimeInterval;
+
+	/* Events since the caller last took the message */
+	p2jaudio_control_message	message;
+} p2jaudio_control;
+
+
+static inline int p2jaudio_control_timeToFrames(const p2jaudio_control* control, double time) {
+	return (int)ceil(control->rate * time);
+}
+
+static inline double p2jaudio_control_framesToTime(const p2jaudio_control* control, int frames) {
+	return frames / (double)control->rate;
+}
+
+static inline void p2jaudio_control_clearUnderrun(p2jaudio_control* control) {
+	control->bufferUnderrunSide = -1;
+	control->bufferUnderrunAmount = 0;
+	control->bufferUnderrunTotalTime = 0;
+}
+
+/* Starts with an empty buffer of latency 'maxFrames', benchmarkStatus and maxBufferTime are kept */
+static inline void p2jaudio_control_init(p2jaudio_control* control, int rate, int nChannels, int periodSize,
+		int readFrames, int bufferFrames, int maxFrames) {
+	control->rate = rate;
+	control->nChannels = nChannels;
+	control->periodSize = periodSize;
+	control->readFrames = readFrames;
+	control->bufferFrames = bufferFrames;
+	control->maxFrames = maxFrames;
+	control->primed = 0;
+	control->missedFrames = 0;
+	control->fill = 0;
+	control->excessFrames = 0;
+	control->minExcessFrames = 0;
+	control->pulseFrames = 0;
+	control->pulseSwitches = 0;
+
+	p2jaudio_control_clearUnderrun(control);
+	control->bufferUnderrunLastTime = 0;
+	control->maxBufferUnderrunTimeInterval = p2jaudio_control_framesToTime(control, maxFrames) * MAX_BUFFER_UNDERRUN_TIME_MULTIPLIER;
+}
+
+static inline void p2jaudio_control_initBenchmark(p2jaudio_control* control) {
+	control->message.events |= P2JAUDIO_MESSAGE_BENCHMARK_STARTED;
+
+	control->benchmarkMinFrames = p2jaudio_control_timeToFrames(control, MIN_BENCHMARK_TIME);
+	control->benchmarkMaxFrames = p2jaudio_control_timeToFrames(control, MAX_BENCHMARK_TIME);
+
+	control->benchmarkFrameCounter = 0;
+	control->benchmarkTotalFrameCounter = 0;
+	control->benchmarkCountTo = control->benchmarkMinFrames;
+	control->benchmarkMaxMissedFrames = 0;
+}
+
+/* Sets the latency of the running buffer: the calibrated 'frames' (which include a jack period) plus one pulse read,
+   by which the fill rises and falls between the periods of jack. Jack then drops the frames above it. */
+static inline void p2jaudio_control_calibrate(p2jaudio_control* control, int frames) {
+	int maxFrames = frames + control->readFrames;
+	if (maxFrames > control->bufferFrames - control->periodSize - control->readFrames)
+		maxFrames = control->bufferFrames - control->periodSize - control->readFrames;
+
+	control->maxBufferTime = p2jaudio_control_framesToTime(control, maxFrames);
+	control->maxFrames = maxFrames;
+
+	p2jaudio_control_clearUnderrun(control);
+	control->maxBufferUnderrunTimeInterval = p2jaudio_control_framesToTime(control, maxFrames) * MAX_BUFFER_UNDERRUN_TIME_MULTIPLIER;
+}
+
+static inline int p2jaudio_control_updateBenchmark(p2jaudio_control* control, int side, int frames) {
+	if (control->benchmarkFrameCounter >= control->benchmarkCountTo) {
+		const int maxMissedFrames = control->benchmarkMaxMissedFrames;
+		const int bufferFrames = (/* 1.25 * */ 2*maxMissedFrames > control->readFrames ? 2*maxMissedFrames : control->readFrames) + control->periodSize;
+		p2jaudio_control_calibrate(control, bufferFrames);
+		control->message.events |= P2JAUDIO_MESSAGE_BENCHMARK_ENDED;
+		control->message.benchmarkMaxMissedFrames = maxMissedFrames;
+		control->message.maxFrames = control->maxFrames;
+		control->message.maxBufferTime = control->maxBufferTime;
+		return 2;
+	}
+
+	const int magnitude = (1 - 2*side) * control->missedFrames;
+	control->benchmarkFrameCounter += frames;
+
+	if (magnitude > control->benchmarkMaxMissedFrames) {
+		control->benchmarkMaxMissedFrames = magnitude;
+		control->benchmarkTotalFrameCounter += control->benchmarkFrameCounter;
+		control->benchmarkFrameCounter = 0;
+		control->benchmarkCountTo = 2 * control->benchmarkMaxMissedFrames;
+		if (control->benchmarkCountTo > control->benchmarkMaxFrames - control->benchmarkTotalFrameCounter)
+			control->benchmarkCountTo = control->benchmarkMaxFrames - control->benchmarkTotalFrameCounter;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Restarts the benchmark in the background after switching to another source, since it has another latency,
+   unless the benchmark was skipped. */
+static inline int p2jaudio_control_recalibrate(p2jaudio_control* control) {
+	if (control->benchmarkStatus >= 0 && control->benchmarkStatus <= 2) {
+		p2jaudio_control_initBenchmark(control);
+		control->benchmarkStatus = 0;
+	}
+	return P2JAUDIO_DECISION_SWITCHED;
+}
+
+/* Returns -2 when the underruns are too frequent to go on, -1 on an underrun (then the caller resets the buffer),
+   0 when more than the latency behind, and 1 otherwise. */
+static inline int p2jaudio_control_updateUnderrun(p2jaudio_control* control, int side, double now) {
+	const int multiplier = 1 - 2*side;
+	const int magnitude = multiplier * control->missedFrames;
+
+	if ( (magnitude + control->maxFrames / 2 >= 0) &&
+			(control->bufferUnderrunSide == side) )
+		p2jaudio_control_clearUnderrun(control);
+
+	if (magnitude > control->maxFrames) {
+		if (magnitude > 2*control->maxFrames) {
+			control->message.events |= P2JAUDIO_MESSAGE_UNDERRUN;
+			control->message.underruns++;
+			control->missedFrames -= multiplier * control->maxFrames;
+
+			if (control->bufferUnderrunSide == -1)
+				control->bufferUnderrunLastTime = now;
+			else
+				control->bufferUnderrunTotalTime += now - control->bufferUnderrunLastTime;
+			control->bufferUnderrunSide = 1 - side;
+			control->bufferUnderrunAmount++;
+			PROBE3(underrun, side, control->missedFrames, control->bufferUnderrunAmount);
+
+			if ( (control->bufferUnderrunTotalTime / control->bufferUnderrunAmount <= control->maxBufferUnderrunTimeInterval) &&
+						(control->bufferUnderrunAmount >= MIN_BUFFER_UNDERRUN_AMOUNT) ) {
+				control->message.events |= P2JAUDIO_MESSAGE_SHUTDOWN;
+				return -2;
+			}
+
+			return -1;
+		}
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Decisions shared by both sides */
+static inline int p2jaudio_control_update(p2jaudio_control* control, int side, int frames, double now) {
+	int decisions = 0;
+
+	// The benchmark runs in the background, while the audio already flows
+	if (control->benchmarkStatus < 2) {
+		const int benchmarkStatus = p2jaudio_control_updateBenchmark(control, side, frames);
+		if (benchmarkStatus == 2)
+			decisions |= P2JAUDIO_DECISION_CALIBRATED;
+		if (benchmarkStatus > control->benchmarkStatus)
+			control->benchmarkStatus = benchmarkStatus;
+	}
+
+	switch (p2jaudio_control_updateUnderrun(control, side, now)) {
+		case -2: decisions |= P2JAUDIO_DECISION_SHUTDOWN; break;
+		case -1: decisions |= P2JAUDIO_DECISION_RESET; break;
+		case 0: decisions |= P2JAUDIO_DECISION_LATE; break;
+	}
+	return decisions;
+}
+
+/* Called by jack for every period of 'frames' frames, before reading it from the ring.
+   'pulseFrames' and 'pulseSwitches' count the frames written by pulse and its switches of source since the (re)start,
+   the ones since the previous period are handled first, as one read of pulse.
+   Unless SHUTDOWN or SILENCE is returned, the caller reads the period, and drops '*dropFrames' frames more. */
+static inline int p2jaudio_control_jack(p2jaudio_control* control, p2jaudio_ring* ring, int frames,
+		long long pulseFrames, int pulseSwitches, double now, int* dropFrames) {
+	*dropFrames = 0;
+	int decisions = 0;
+
+	// Another source has another latency, so calibrate again
+	if (pulseSwitches != control->pulseSwitches) {
+		control->pulseSwitches = pulseSwitches;
+		decisions |= p2jaudio_control_recalibrate(control);
+	}
+
+	if (pulseFrames != control->pulseFrames) {
+		const int newFrames = (int)(pulseFrames - control->pulseFrames);
+		control->pulseFrames = pulseFrames;
+		control->missedFrames -= newFrames;
+
+		decisions |= p2jaudio_control_update(control, 1, newFrames, now);
+		if (decisions & P2JAUDIO_DECISION_SHUTDOWN)
+			return decisions;
+		if (decisions & P2JAUDIO_DECISION_RESET) {
+			// Drop the buffered samples, without moving the write position back, and fill it up again
+			p2jaudio_ring_skip(ring);
+			control->primed = 0;
+		}
+	}
+
+	control->missedFrames += frames;
+	decisions |= p2jaudio_control_update(control, 0, frames, now);
+	if (decisions & P2JAUDIO_DECISION_SHUTDOWN)
+		return decisions;
+
+	// Output silence until the buffer is filled up to its latency, after a (re)start or a reset
+	const int fill = control->fill = p2jaudio_ring_fill(ring);
+	if (!control->primed) {
+		if (fill < control->nChannels * control->maxFrames)
+			return decisions | P2JAUDIO_DECISION_SILENCE;
+		control->primed = 1;
+	}
+
+	// When the buffer has held more than its latency for DROP_DELAY_TIME (e.g. after the calibration),
+	// drop a part of a period, of what it held more all that time
+	const int excessFrames = fill / control->nChannels - control->maxFrames;
+	if (excessFrames <= 0) {
+		control->excessFrames = 0;
+		return decisions;
+	}
+	if (control->excessFrames == 0 || excessFrames < control->minExcessFrames)
+		control->minExcessFrames = excessFrames;
+	control->excessFrames += frames;
+	if (control->excessFrames < p2jaudio_control_timeToFrames(control, DROP_DELAY_TIME))
+		return decisions;
+
+	const int maxDropFrames = (int)(MAX_DROP_FRACTION * frames);
+	*dropFrames = (control->minExcessFrames < maxDropFrames ? control->minExcessFrames : maxDropFrames);
+	control->minExcessFrames -= *dropFrames;
+	// Once that is dropped, wait again before dropping more
+	if (control->minExcessFrames == 0)
+		control->excessFrames = 0;
+	if (*dropFrames > 0)
+		decisions |= P2JAUDIO_DECISION_DROP;
+
+	return decisions;
+}
+
+/* Prints the message of the control, from a thread that may print, and clears it */
+static inline void p2jaudio_control_printMessage(p2jaudio_control_message* message) {
+	if (message->events & P2JAUDIO_MESSAGE_BENCHMARK_STARTED)
+		printf ("Benchmark started, in the background.\n");
+	if (message->events & P2JAUDIO_MESSAGE_BENCHMARK_ENDED)
+		// The latency the buffer is reduced to, which is the one it keeps
+		printf ("Benchmark ended: benchmarkMaxMissedFrames ended with %d => \n\t latency of %fms; I'll reduce the buffer to %dframes.\n",
+				message->benchmarkMaxMissedFrames, 1000 * message->maxBufferTime, message->maxFrames);
+	if (message->events & P2JAUDIO_MESSAGE_UNDERRUN) {
+		if (message->underruns > 1)
+			printf ("Buffer underrun (%d times).\n", message->underruns);
+		else
+			printf ("Buffer underrun.\n");
+	}
+	if (message->events & P2JAUDIO_MESSAGE_SHUTDOWN)
+		printf ("Shutting down: Too frequent buffer underruns.\n");
+	memset(message, 0, sizeof(p2jaudio_control_message));
+}
+
+#endif
@@ -0,0 +1,1775 @@
+/**
+
+Author: Elias Vanderstuyft (Elias.vds[at]gmail.com)
+        Parts (for pulse-simple) are based on the code example 'parec-simple.c' on 'freedesktop.org'.
+        For expansion using the standard pulse lib (so not pulse-simple),
+        I suggest to look at the 'pavucontrol' source code as a guiding line.
+Name: libp2jaudio
+Description: The pipe from a PulseAudio Source device into the process callback of an application, see 'p2jaudio.h'.
+The pulse thread reads from pulse into the ring buffer, the process callback of the application reads from it,
+and the control thread of the pipe (re)starts and stops it, so the application doesn't have to.
+
+**/
+
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <pulse/simple.h>
+#include <pulse/error.h>
+#include <pulse/mainloop.h>
+#include <pulse/context.h>
+#include <pulse/introspect.h>
+
+#include "p2jaudio.h"
+#include "p2jaudio_pipe.h"
+#include "p2jaudio_ring.h"
+#include "p2jaudio_control.h"
+#include "p2jaudio_trace.h"
+#include "p2jaudio_resample.h"
+#include "p2jaudio_shm.h"
+#include "p2jaudio_probes.h"
+
+
+
+#define DEBUG 0
+
+
+#define USE_BENCHMARK 1
+#define PULSE_MAX_BUFFER_TIME 1.0
+
+/* Latency used while the benchmark calibrates the buffer in the background */
+#define CALIBRATION_BUFFER_TIME 0.1
+
+/* In throughput mode, the time of audio read from pulse at once */
+#define THROUGHPUT_READ_TIME 0.04
+
+/* Maximum time pulse may take to connect, by default */
+#define STARTUP_TIMEOUT 10.0
+/* Pulse is connected before the pipe is started, assuming that the application will use this rate */
+#define EXPECTED_RATE 48000
+/* ...and in fragments of a common period size */
+#define PRECONNECT_PERIOD_SIZE 256
+/* A stream is reused for reads of at most this many fragments, since the source wakes up for every fragment */
+#define MAX_FRAGMENTS_PER_READ 4
+
+/* Part of the pre-roll buffer that is not dumped, since it may be overwritten during the dump */
+#define PREROLL_DUMP_MARGIN_TIME 1.0
+
+/* Records of the callback trace that fit in memory, until the control thread writes them out */
+#define TRACE_BUFFER_RECORDS 65536
+
+/* When switching to another source, both are read and crossfaded for (at least) this long */
+#define SWITCH_CROSSFADE_TIME 0.005
+
+/* Interval at which the control thread wakes up, when nothing happens */
+#define WAIT_INTERVAL 0.2
+
+
+
+
+
+/* prototypes */
+
+static int pipe_processCycle(p2jaudio_pipe* pipe, float** buffers, int frames);
+static void pipe_silence(p2jaudio_pipe* pipe, float** buffers, int frames);
+static void pipe_postControlMessage(p2jaudio_pipe* pipe);
+static void pipe_printControlMessages(p2jaudio_pipe* pipe);
+static p2jaudio_pipe* pipe_alloc();
+static void pipe_dealloc(p2jaudio_pipe* pipe);
+
+/** These ones should be replaced by the non-simple pulse lib **/
+static void pulseServer_setProcessCallback(p2jaudio_pipe* pipe, int (*cb)(p2jaudio_pipe* pipe));
+static void pulseServer_start(p2jaudio_pipe* pipe);
+static void* pulseServer_run(void* arg);
+static void pulseServer_stop(p2jaudio_pipe* pipe);
+
+static pulseConnection* pulse_connect(char* sourceName, char* device, int rate, int nChannels, int fragmentFrames, double deadline);
+static pa_simple* pulse_waitConnected(p2jaudio_pipe* pipe, pulseConnection* connection);
+static void pulse_abandon(pulseConnection* connection);
+static void pulse_freeConnection(pulseConnection* connection);
+static int pulse_getSourceRate(const char* device, double deadline);
+static void pulse_resolveCaptureRate(p2jaudio_pipe* pipe);
+static int pulse_start(p2jaudio_pipe* pipe, char* sourceName, int rate, int nChannels);
+static int pulse_process(p2jaudio_pipe* pipe);
+static int pulse_processRead(p2jaudio_pipe* pipe);
+static int pulse_stop(p2jaudio_pipe* pipe);
+static int pulse_switch(p2jaudio_pipe* pipe, char* device);
+static void pulse_crossfade(p2jaudio_pipe* pipe, float* samples, const float* switchSamples, int frames);
+static void pulse_freeRetired(p2jaudio_pipe* pipe);
+
+static void getSafeName(p2jaudio_pipe* pipe, char* dest);
+
+static float* shm_start(p2jaudio_pipe* pipe, int ringSize);
+static void shm_beginWrite(p2jaudio_pipe* pipe);
+static void shm_endWrite(p2jaudio_pipe* pipe, int size);
+static int shm_stop(p2jaudio_pipe* pipe);
+
+static int preroll_start(p2jaudio_pipe* pipe);
+static void preroll_write(p2jaudio_pipe* pipe, const float* samples, int size);
+static int preroll_dump(p2jaudio_pipe* pipe, double time);
+static int preroll_stop(p2jaudio_pipe* pipe);
+
+static int trace_start(p2jaudio_pipe* pipe);
+static void trace_lock(p2jaudio_pipe* pipe);
+static void trace_unlock(p2jaudio_pipe* pipe);
+static void trace_record(p2jaudio_pipe* pipe, int type, int decisions, double time, int frames, int dropFrames);
+static void trace_recordStart(p2jaudio_pipe* pipe);
+static void trace_flush(p2jaudio_pipe* pipe);
+static int trace_stop(p2jaudio_pipe* pipe);
+
+static int timeToFrames(p2jaudio_pipe* pipe, double time);
+static int startProcess(p2jaudio_pipe* pipe);
+static int getReadFrames(p2jaudio_pipe* pipe, int rate, int periodSize);
+static int getCaptureRate(p2jaudio_pipe* pipe, int rate);
+static int getCaptureReadFrames(int captureRate, int rate, int readFrames);
+static int initBuffer(p2jaudio_pipe* pipe);
+static void freeBuffer(p2jaudio_pipe* pipe);
+static int stopProcess(p2jaudio_pipe* pipe);
+static int restartProcess(p2jaudio_pipe* pipe);
+
+static void start(p2jaudio_pipe* pipe);
+static int stop(p2jaudio_pipe* pipe);
+static void* control_run(void* arg);
+
+static void changeState(p2jaudio_pipe* pipe, int newState);
+static int advanceState(p2jaudio_pipe* pipe, int oldState, int newState);
+static int waitForWakeup(p2jaudio_pipe* pipe, double timeout);
+static void wakeup(p2jaudio_pipe* pipe);
+
+
+/* file-global variables */
+
+/* The connections to pulse of all pipes are waited for on connectCond */
+static pthread_mutex_t	connectMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	connectCond = PTHREAD_COND_INITIALIZER;
+
+
+
+
+
+static int imin(int a, int b) {
+	return a < b ? a : b;
+}
+static int imax(int a, int b) {
+	return a > b ? a : b;
+}
+
+static double getTime() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + (double)tv.tv_usec / 1000000;
+}
+
+/* CPU time of the calling thread */
+static double getThreadTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + (double)ts.tv_nsec / 1000000000;
+}
+
+
+
+/* Waits on 'connectCond' until '*status' is no longer 0, returns -1 when 'deadline' passed */
+static int waitForConnect(int* status, double deadline) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)deadline;
+	ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1000000000);
+	
+	int ret = 0;
+	pthread_mutex_lock(&connectMutex);
+	while (*status == 0 && ret == 0)
+		if (pthread_cond_timedwait(&connectCond, &connectMutex, &ts) == ETIMEDOUT)
+			ret = -1;
+	if (*status != 0)
+		ret = 0;
+	pthread_mutex_unlock(&connectMutex);
+	return ret;
+}
+
+
+int p2jaudio_pipe_process(p2jaudio_pipe* pipe, float** buffers, int frames)
+{
+	PROBE1(jack_process_entry, frames);
+	const int ret = pipe_processCycle(pipe, buffers, frames);
+	PROBE1(jack_process_exit, ret);
+	return ret;
+}
+
+static int pipe_processCycle(p2jaudio_pipe* pipe, float** buffers, int frames)
+{
+	// Without taking todoMutex, so the callback doesn't write to the cache line of the control thread
+	if (__atomic_load_n(&pipe->todo, __ATOMIC_ACQUIRE) > -1) {
+		pipe_silence(pipe, buffers, frames);
+		return 0;
+	}
+	
+	pthread_mutex_lock(&pipe->bufferMutex);
+	
+	int state = __atomic_load_n(&pipe->state, __ATOMIC_ACQUIRE);
+	if (state == 0 && advanceState(pipe, 0, 1)) {
+		#if (DEBUG==1)
+		printf ("Process callback: state increased to 1.\n");
+		#endif
+		state = 1;
+	}
+	
+	if (state < 2) {
+		pthread_mutex_unlock(&pipe->bufferMutex);
+		pipe_silence(pipe, buffers, frames);
+		return 0;
+	}
+	
+	if (pipe->nChannels * frames != pipe->pulsePeriodSize) {
+		#if (DEBUG==1)
+		printf ("Failed assertion: (nChannels * frames = %d) != (pulsePeriodSize = %d)\n", pipe->nChannels * frames, pipe->pulsePeriodSize);
+		#endif
+		pthread_mutex_unlock(&pipe->bufferMutex);
+		pipe_silence(pipe, buffers, frames);
+		stop(pipe);
+		return 0;
+	}
+	
+	// The benchmark starts with the first period in which both sides run
+	if (USE_BENCHMARK && pipe->control.benchmarkStatus == -1)
+		p2jaudio_control_initBenchmark(&pipe->control);
+	
+	trace_lock(pipe);
+	
+	const double now = getTime();
+	int dropFrames;
+	int decisions = p2jaudio_pipe_controlPeriod(pipe, frames, now, &dropFrames);
+	pipe_postControlMessage(pipe);
+	if (decisions & P2JAUDIO_DECISION_SHUTDOWN) {
+		trace_record(pipe, P2JAUDIO_TRACE_JACK, decisions, now, frames, 0);
+		trace_unlock(pipe);
+		pthread_mutex_unlock(&pipe->bufferMutex);
+		pipe_silence(pipe, buffers, frames);
+		stop(pipe);
+		return 0;
+	}
+	
+	if (decisions & P2JAUDIO_DECISION_SILENCE) {
+		pipe_silence(pipe, buffers, frames);
+		trace_record(pipe, P2JAUDIO_TRACE_JACK, decisions, now, frames, 0);
+		trace_unlock(pipe);
+		pthread_mutex_unlock(&pipe->bufferMutex);
+		return 0;
+	}
+	
+	#if (DEBUG==1)
+	printf ("Process callback.\n");
+	#endif
+	
+	if (dropFrames > 0)
+		PROBE1(ring_drop, dropFrames);
+	// The probes get what the latency control already saw, so they cost nothing more than a nop
+	if (p2jaudio_ring_read(&pipe->pulseRing, buffers, pipe->nChannels, frames, dropFrames)) {
+		PROBE1(ring_underrun, pipe->control.fill);
+		decisions |= P2JAUDIO_DECISION_STARVED;
+	}
+	PROBE2(ring_read, pipe->control.fill, pipe->control.missedFrames);
+	trace_record(pipe, P2JAUDIO_TRACE_JACK, decisions, now, frames, dropFrames);
+	trace_unlock(pipe);
+	
+	if (pipe->firstAudioTime == 0)
+		pipe->firstAudioTime = now;
+
+	pthread_mutex_unlock(&pipe->bufferMutex);
+	return 1;
+}
+
+/* Jack, under bufferMutex: hands the message of the latency control to the control thread, which prints it.
+   While the control thread is behind, the message stays in the control, collecting the next events. */
+static void pipe_postControlMessage(p2jaudio_pipe* pipe)
+{
+	p2jaudio_control_message* message = &pipe->control.message;
+	if (message->events == 0)
+		return;
+	
+	const uint64_t writeIndex = pipe->controlMessageWriteIndex;
+	if (writeIndex - __atomic_load_n(&pipe->controlMessageReadIndex, __ATOMIC_ACQUIRE) >= MAX_CONTROL_MESSAGES)
+		return;
+	pipe->controlMessages[writeIndex % MAX_CONTROL_MESSAGES] = *message;
+	memset(message, 0, sizeof(p2jaudio_control_message));
+	__atomic_store_n(&pipe->controlMessageWriteIndex, writeIndex + 1, __ATOMIC_RELEASE);
+	wakeup(pipe);
+}
+
+/* Control thread: prints the messages jack handed over */
+static void pipe_printControlMessages(p2jaudio_pipe* pipe)
+{
+	const uint64_t writeIndex = __atomic_load_n(&pipe->controlMessageWriteIndex, __ATOMIC_ACQUIRE);
+	uint64_t readIndex;
+	for (readIndex = pipe->controlMessageReadIndex; readIndex != writeIndex; readIndex++) {
+		p2jaudio_control_printMessage(&pipe->controlMessages[readIndex % MAX_CONTROL_MESSAGES]);
+		__atomic_store_n(&pipe->controlMessageReadIndex, readIndex + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void pipe_silence(p2jaudio_pipe* pipe, float** buffers, int frames)
+{
+	int i;
+	for (i = 0; i < pipe->nChannels; i++)
+		memset(buffers[i], 0, sizeof(float) * frames);
+}
+
+
+static void pulseServer_setProcessCallback(p2jaudio_pipe* pipe, int (*cb)(p2jaudio_pipe* pipe)) {
+	pipe->pulseServer_processCb = cb;
+}
+static void pulseServer_start(p2jaudio_pipe* pipe)
+{
+	if (pipe->pulseRunning)
+		return;
+	
+	__atomic_store_n(&pipe->pulseRunning, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&pipe->pulseServerThread, NULL, pulseServer_run, pipe) != 0) {
+		printf ("Failed to create Pulse Server thread.\n");
+		pipe->pulseRunning = 0;
+	}
+}
+static void* pulseServer_run(void* arg)
+{
+	p2jaudio_pipe* pipe = arg;
+	printf ("Pulse Server has started.\n");
+	
+	while (__atomic_load_n(&pipe->pulseRunning, __ATOMIC_ACQUIRE)) {
+		(*pipe->pulseServer_processCb)(pipe);
+	}
+	
+	printf ("Pulse Server has ended.\n");
+	return NULL;
+}
+static void pulseServer_stop(p2jaudio_pipe* pipe)
+{
+	if (!pipe->pulseRunning)
+		return;
+	
+	// Returns after the current read (at most one pulse read) finished
+	__atomic_store_n(&pipe->pulseRunning, 0, __ATOMIC_RELEASE);
+	pthread_join(pipe->pulseServerThread, NULL);
+}
+
+/* Connecting to pulse may hang, so it's done in a separate thread.
+   The connection is freed by whoever sees it last: the waiter, or the thread when it was abandoned. */
+struct pulseConnection {
+	char*		sourceName;
+	char*		device;		/* NULL: the default source */
+	int			rate;		/* -1: the native rate of the source, set once it is known */
+	int			nChannels;
+	int			fragmentFrames;	/* at 'rate', the stream can be read in any multiple of them */
+	double		deadline;	/* of getting the native rate */
+	pa_simple*	stream;
+	int			error;
+	int			status;		/* 0: connecting, 1: connected, -1: failed */
+	int			abandoned;
+};
+
+static void* pulse_connectRun(void* arg)
+{
+	pulseConnection* connection = arg;
+	
+	// The native rate is queried here, so it doesn't hold up the start of the application
+	int rate = connection->rate;
+	int fragmentFrames = connection->fragmentFrames;
+	if (rate == -1) {
+		if ((rate = pulse_getSourceRate(connection->device, connection->deadline)) == -1) {
+			pthread_mutex_lock(&connectMutex);
+			connection->status = -1;
+			const int abandoned = connection->abandoned;
+			pthread_cond_broadcast(&connectCond);
+			pthread_mutex_unlock(&connectMutex);
+			if (abandoned)
+				pulse_freeConnection(connection);
+			return NULL;
+		}
+		// Fragments given at EXPECTED_RATE, rounded down, so they stay no larger than a read
+		fragmentFrames = imax((int)floor((double)fragmentFrames * rate / EXPECTED_RATE), 1);
+	}
+	
+	/* The sample type to use */
+	const pa_sample_spec ss = {
+		.format = PA_SAMPLE_FLOAT32LE,
+		.rate = rate,
+		.channels = connection->nChannels
+	};
+
+	/* Let the server deliver the data in fragments of (at most) one read */
+	const pa_buffer_attr attr = {
+		.maxlength = (uint32_t)-1,
+		.tlength = (uint32_t)-1,
+		.prebuf = (uint32_t)-1,
+		.minreq = (uint32_t)-1,
+		.fragsize = sizeof(float) * connection->nChannels * fragmentFrames
+	};
+
+	/* Create the recording stream */
+	int error;
+	pa_simple* stream = pa_simple_new(NULL, connection->sourceName, PA_STREAM_RECORD, connection->device, "record", &ss, NULL, &attr, &error);
+	
+	pthread_mutex_lock(&connectMutex);
+	if (connection->rate == -1) {
+		connection->rate = rate;
+		connection->fragmentFrames = fragmentFrames;
+	}
+	connection->stream = stream;
+	connection->error = error;
+	connection->status = (stream != NULL ? 1 : -1);
+	const int abandoned = connection->abandoned;
+	pthread_cond_broadcast(&connectCond);
+	pthread_mutex_unlock(&connectMutex);
+	
+	if (abandoned) {
+		if (stream != NULL)
+			pa_simple_free(stream);
+		pulse_freeConnection(connection);
+	}
+	return NULL;
+}
+
+/* 'sourceName' and 'device' are copied, so an abandoned connection may outlive its pipe.
+   With a 'rate' of -1, the source is captured at its native rate, and 'fragmentFrames' are at EXPECTED_RATE. */
+static pulseConnection* pulse_connect(char* sourceName, char* device, int rate, int nChannels, int fragmentFrames, double deadline)
+{
+	pulseConnection* connection;
+	if ((connection = calloc(1, sizeof(pulseConnection))) == NULL)
+		return NULL;
+	if ((connection->sourceName = strdup(sourceName)) == NULL ||
+			(device != NULL && strlen(device) > 0 && (connection->device = strdup(device)) == NULL)) {
+		pulse_freeConnection(connection);
+		return NULL;
+	}
+	connection->rate = rate;
+	connection->nChannels = nChannels;
+	connection->fragmentFrames = fragmentFrames;
+	connection->deadline = deadline;
+	
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, pulse_connectRun, connection) != 0) {
+		pulse_freeConnection(connection);
+		return NULL;
+	}
+	pthread_detach(thread);
+	return connection;
+}
+
+static pa_simple* pulse_waitConnected(p2jaudio_pipe* pipe, pulseConnection* connection)
+{
+	if (connection == NULL) {
+		printf ("Failed to create pulse connection thread.\n");
+		return NULL;
+	}
+	
+	if (waitForConnect(&connection->status, pipe->startupDeadline) == -1) {
+		printf ("Pulse did not connect within %fs.\n", pipe->startupTimeout);
+		pulse_abandon(connection);
+		return NULL;
+	}
+	
+	pa_simple* stream = connection->stream;
+	if (stream == NULL)
+		fprintf(stderr, __FILE__": pa_simple_new() failed: %s\n", pa_strerror(connection->error));
+	pulse_freeConnection(connection);
+	return stream;
+}
+
+static void pulse_abandon(pulseConnection* connection)
+{
+	if (connection == NULL)
+		return;
+	
+	pthread_mutex_lock(&connectMutex);
+	const int status = connection->status;
+	connection->abandoned = 1;
+	pthread_mutex_unlock(&connectMutex);
+	
+	if (status != 0) {
+		if (connection->stream != NULL)
+			pa_simple_free(connection->stream);
+		pulse_freeConnection(connection);
+	}
+}
+
+static void pulse_freeConnection(pulseConnection* connection)
+{
+	free(connection->sourceName);
+	free(connection->device);
+	free(connection);
+}
+
+static void pulse_sourceInfoCallback(pa_context* context, const pa_source_info* info, int eol, void* userdata)
+{
+	int* sourceRate = userdata;
+	if (eol == 0 && info != NULL)
+		*sourceRate = info->sample_spec.rate;
+	else if (*sourceRate == 0)
+		*sourceRate = -1;
+}
+
+/* Returns the rate of the source pulse-simple records from ('device', $PULSE_SOURCE, or the default source),
+   or -1 when it isn't known before 'deadline' */
+static int pulse_getSourceRate(const char* device, double deadline)
+{
+	const char* source = (device != NULL ? device : getenv("PULSE_SOURCE"));
+	if (source == NULL)
+		source = "@DEFAULT_SOURCE@";
+	
+	pa_mainloop* mainloop = pa_mainloop_new();
+	if (mainloop == NULL)
+		return -1;
+	pa_context* context = pa_context_new(pa_mainloop_get_api(mainloop), "p2jaudio");
+	if (context == NULL || pa_context_connect(context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+		if (context != NULL)
+			pa_context_unref(context);
+		pa_mainloop_free(mainloop);
+		return -1;
+	}
+	
+	// Iterate the mainloop by hand, so it can't hang beyond the deadline
+	pa_operation* operation = NULL;
+	int sourceRate = 0;
+	while (sourceRate == 0) {
+		const pa_context_state_t contextState = pa_context_get_state(context);
+		const double timeLeft = deadline - getTime();
+		if (!PA_CONTEXT_IS_GOOD(contextState) || timeLeft <= 0) {
+			sourceRate = -1;
+			break;
+		}
+		if (contextState == PA_CONTEXT_READY && operation == NULL &&
+				(operation = pa_context_get_source_info_by_name(context, source, pulse_sourceInfoCallback, &sourceRate)) == NULL) {
+			sourceRate = -1;
+			break;
+		}
+		if (pa_mainloop_prepare(mainloop, (int)(1000000 * fmin(timeLeft, WAIT_INTERVAL))) < 0 ||
+				pa_mainloop_poll(mainloop) < 0 || pa_mainloop_dispatch(mainloop) < 0) {
+			sourceRate = -1;
+			break;
+		}
+	}
+	
+	if (operation != NULL)
+		pa_operation_unref(operation);
+	pa_context_disconnect(context);
+	pa_context_unref(context);
+	pa_mainloop_free(mainloop);
+	return sourceRate;
+}
+
+/* With '-R native', waits until the pre-connection knows the rate of the source, and captures at it.
+   Falls back to the jack rate when it isn't known before 'startupDeadline'. */
+static void pulse_resolveCaptureRate(p2jaudio_pipe* pipe)
+{
+	pulseConnection* connection = pipe->pulsePreconnection;
+	int sourceRate = -1;
+	if (connection != NULL && waitForConnect(&connection->status, pipe->startupDeadline) == 0)
+		sourceRate = connection->rate;
+	
+	if (sourceRate == -1) {
+		printf ("Failed to get the native rate of the source, capturing at the jack rate.\n");
+		pulse_abandon(connection);
+		pipe->pulsePreconnection = NULL;
+		pipe->requestedCaptureRate = 0;
+	} else {
+		printf ("Native rate of the source: %dHz.\n", sourceRate);
+		pipe->requestedCaptureRate = sourceRate;
+	}
+}
+
+static int pulse_start(p2jaudio_pipe* pipe, char* sourceName, int rate, int nChannels)
+{
+	pthread_mutex_lock(&pipe->pulseMutex);
+	printf ("Starting Pulse (%d*%dHz)...\n", nChannels, rate);
+	
+	if (pipe->state != -1) {
+		#if (DEBUG==1)
+		printf ("Pulse start: (state = %d) != -1.\n", pipe->state);
+		#endif
+		pthread_mutex_unlock(&pipe->pulseMutex);
+		return -1;
+	}
+	
+	/* Use the connection made during startup, if jack turned out to use the expected rate,
+	   and its fragments are neither larger than a read, nor so much smaller that the source wakes up needlessly often */
+	pulseConnection* connection = pipe->pulsePreconnection;
+	pipe->pulsePreconnection = NULL;
+	if (connection != NULL && (connection->rate != rate || connection->fragmentFrames > pipe->captureReadFrames
+			|| connection->fragmentFrames * MAX_FRAGMENTS_PER_READ < pipe->captureReadFrames)) {
+		printf ("Reconnecting Pulse, jack does not use the expected rate and period size.\n");
+		pulse_abandon(connection);
+		connection = NULL;
+	}
+	if (connection == NULL)
+		connection = pulse_connect(sourceName, pipe->sourceDevice, rate, nChannels, pipe->captureReadFrames, pipe->startupDeadline);
+	
+	if ((pipe->pulseStream = pulse_waitConnected(pipe, connection)) == NULL) {
+		pthread_mutex_unlock(&pipe->pulseMutex);
+		return -1;
+	}
+	
+	pulseServer_setProcessCallback(pipe, pulse_process);
+	pulseServer_start(pipe);
+	printf ("Pulse started.\n");
+	
+	pthread_mutex_unlock(&pipe->pulseMutex);
+	return 0;
+}
+
+static int pulse_process(p2jaudio_pipe* pipe)
+{
+	PROBE1(pulse_process_entry, pipe->pulseReadFrames);
+	const int ret = pulse_processRead(pipe);
+	PROBE2(pulse_process_exit, ret, p2jaudio_ring_writerFill(&pipe->pulseRing));
+	return ret;
+}
+
+static int pulse_processRead(p2jaudio_pipe* pipe)
+{
+	if (__atomic_load_n(&pipe->todo, __ATOMIC_ACQUIRE) > -1)
+		return 0;
+	
+	pthread_mutex_lock(&pipe->pulseMutex);
+	
+	if (__atomic_load_n(&pipe->state, __ATOMIC_ACQUIRE) < 0) {
+		pthread_mutex_unlock(&pipe->pulseMutex);
+		return -1;
+	}
+	
+	float* tmpBuffer = pipe->captureBuffer;
+
+	/* Record some data ... */
+	int error;
+	if (pa_simple_read(pipe->pulseStream, tmpBuffer, sizeof(float) * pipe->captureReadSize, &error) < 0) {
+		fprintf(stderr, __FILE__": pa_simple_read() failed: %s\n", pa_strerror(error));
+		pthread_mutex_unlock(&pipe->pulseMutex);
+		stop(pipe);
+		return -1;
+	}
+	
+	// While switching to another source, read it as well and crossfade to it
+	int switched = 0;
+	if (pipe->pulseSwitchStream != NULL) {
+		float* switchBuffer = pipe->switchBuffer;
+		if (pa_simple_read(pipe->pulseSwitchStream, switchBuffer, sizeof(float) * pipe->captureReadSize, &error) < 0) {
+			fprintf(stderr, __FILE__": pa_simple_read() of source '%s' failed: %s\n", pipe->pulseSwitchDevice, pa_strerror(error));
+			pipe->pulseRetiredStream = pipe->pulseSwitchStream;
+			pipe->pulseSwitchStream = NULL;
+			wakeup(pipe);
+		} else {
+			pulse_crossfade(pipe, tmpBuffer, switchBuffer, pipe->captureReadFrames);
+			if (pipe->pulseSwitchFrames >= pipe->pulseSwitchTotalFrames) {
+				pipe->pulseRetiredStream = pipe->pulseStream;
+				pipe->pulseStream = pipe->pulseSwitchStream;
+				pipe->pulseSwitchStream = NULL;
+				strcpy(pipe->sourceDevice, pipe->pulseSwitchDevice);
+				switched = 1;
+				wakeup(pipe);
+			}
+		}
+	}
+	
+	pthread_mutex_unlock(&pipe->pulseMutex);
+	
+	if (switched)
+		printf ("Switched to source '%s'.\n", pipe->sourceDevice);
+	
+	// Convert to the jack rate, here rather than in the realtime thread
+	float* resampleBuffer = pipe->resampleBuffer;
+	const float* samples = tmpBuffer;
+	int writeFrames = pipe->captureReadFrames;
+	if (pipe->resampler != NULL) {
+		const double startTime = getThreadTime();
+		writeFrames = p2jaudio_resampler_process(pipe->resampler, tmpBuffer, pipe->captureReadFrames, resampleBuffer);
+		pipe->resampleTime += getThreadTime() - startTime;
+		pipe->resampledFrames += pipe->captureReadFrames;
+		samples = resampleBuffer;
+	}
+	const int writeSize = pipe->nChannels * writeFrames;
+	
+	if (pipe->prerollBuffer != NULL)
+		preroll_write(pipe, samples, writeSize);
+	
+	// Without taking bufferMutex: pulse only writes the ring and publishes its progress,
+	// the process callback catches up on it in the latency control
+	
+	const int state = __atomic_load_n(&pipe->state, __ATOMIC_ACQUIRE);
+	if (state < 1)
+		return -1;
+	else if (state == 1 && advanceState(pipe, 1, 2)) {
+		#if (DEBUG==1)
+		printf ("Pulse process: state increased to 2.\n");
+		#endif
+	}
+	
+	#if (DEBUG==1)
+	printf ("Pulse Process.\n");
+	#endif
+	
+	trace_lock(pipe);
+	
+	// When the buffer is full, the samples that don't fit are dropped
+	const double now = getTime();
+	if (pipe->useShm)
+		shm_beginWrite(pipe);
+	const int overflow = p2jaudio_pipe_publishRead(pipe, samples, writeFrames, switched);
+	if (pipe->useShm)
+		shm_endWrite(pipe, writeSize - overflow);
+	
+	int decisions = (switched ? P2JAUDIO_DECISION_SWITCHED : 0);
+	if (overflow > 0) {
+		PROBE1(ring_overflow, overflow);
+		decisions |= P2JAUDIO_DECISION_OVERFLOW;
+	}
+	// Without reading the line of the reader
+	PROBE2(ring_write, p2jaudio_ring_writerFill(&pipe->pulseRing), pipe->pulseFrames);
+	trace_record(pipe, P2JAUDIO_TRACE_PULSE, decisions, now, writeFrames, 0);
+	
+	trace_unlock(pipe);
+	return 0;
+}
+
+static int pulse_stop(p2jaudio_pipe* pipe)
+{
+	printf ("Stopping Pulse...\n");
+	
+	if (pipe->state < -1) {
+		#if (DEBUG==1)
+		printf ("Pulse start: (state = %d) < -1.\n", pipe->state);
+		#endif
+		return -1;
+	}
+	
+	// Without holding pulseMutex, since the pulse server thread needs it to finish its read
+	pulseServer_stop(pipe);
+	
+	pthread_mutex_lock(&pipe->pulseMutex);
+	if (pipe->pulseStream != NULL)
+		pa_simple_free(pipe->pulseStream);
+	pipe->pulseStream = NULL;
+	if (pipe->pulseSwitchStream != NULL)
+		pa_simple_free(pipe->pulseSwitchStream);
+	pipe->pulseSwitchStream = NULL;
+	if (pipe->pulseRetiredStream != NULL)
+		pa_simple_free(pipe->pulseRetiredStream);
+	pipe->pulseRetiredStream = NULL;
+	
+	printf ("Pulse stopped.\n");
+	
+	pthread_mutex_unlock(&pipe->pulseMutex);
+	return 0;
+}
+
+/* Connects to the source 'device' (from the control thread), and lets the pulse thread crossfade to it.
+   Meanwhile the current source keeps being read, so the process callback doesn't notice. */
+static int pulse_switch(p2jaudio_pipe* pipe, char* device)
+{
+	pulse_freeRetired(pipe);
+	
+	pthread_mutex_lock(&pipe->pulseMutex);
+	const int busy = (pipe->state < 0 || pipe->pulseSwitchStream != NULL);
+	pthread_mutex_unlock(&pipe->pulseMutex);
+	if (busy) {
+		printf ("Not switching to source '%s', the process is not running or still switching.\n", device);
+		return -1;
+	}
+	
+	printf ("Switching to source '%s'...\n", device);
+	pipe->startupDeadline = getTime() + pipe->startupTimeout;
+	pa_simple* stream = pulse_waitConnected(pipe, pulse_connect(pipe->sourceName, device, pipe->captureRate, pipe->nChannels,
+			pipe->captureReadFrames, pipe->startupDeadline));
+	if (stream == NULL) {
+		printf ("Failed to switch to source '%s', keeping the current one.\n", device);
+		return -1;
+	}
+	
+	// Drop what was recorded while connecting, so the new source doesn't add latency
+	int error;
+	pa_simple_flush(stream, &error);
+	
+	pthread_mutex_lock(&pipe->pulseMutex);
+	pipe->pulseSwitchStream = stream;
+	strcpy(pipe->pulseSwitchDevice, device);
+	pipe->pulseSwitchFrames = 0;
+	pipe->pulseSwitchTotalFrames = (int)ceil(pipe->captureRate * SWITCH_CROSSFADE_TIME);
+	pthread_mutex_unlock(&pipe->pulseMutex);
+	return 0;
+}
+
+/* Equal-power crossfade from 'samples' to 'switchSamples' (uncorrelated sources), in place */
+static void pulse_crossfade(p2jaudio_pipe* pipe, float* samples, const float* switchSamples, int frames)
+{
+	int i, j;
+	for (j = 0; j < frames; j++) {
+		const double position = (double)(pipe->pulseSwitchFrames + j) / pipe->pulseSwitchTotalFrames;
+		const float fadeOut = (position < 1 ? cos(0.5 * M_PI * position) : 0);
+		const float fadeIn = (position < 1 ? sin(0.5 * M_PI * position) : 1);
+		for (i = 0; i < pipe->nChannels; i++)
+			samples[j * pipe->nChannels + i] = fadeOut * samples[j * pipe->nChannels + i] + fadeIn * switchSamples[j * pipe->nChannels + i];
+	}
+	pipe->pulseSwitchFrames += frames;
+}
+
+static void pulse_freeRetired(p2jaudio_pipe* pipe)
+{
+	pthread_mutex_lock(&pipe->pulseMutex);
+	pa_simple* stream = pipe->pulseRetiredStream;
+	pipe->pulseRetiredStream = NULL;
+	pthread_mutex_unlock(&pipe->pulseMutex);
+	
+	if (stream != NULL)
+		pa_simple_free(stream);
+}
+
+
+
+
+/* Copies the pipe name to 'dest' (of at least 256 bytes), replacing every non-alphanumeric character by '_' */
+static void getSafeName(p2jaudio_pipe* pipe, char* dest)
+{
+	int i;
+	for (i = 0; pipe->sourceName[i] != '\0' && i < 255; i++)
+		dest[i] = (isalnum((unsigned char)pipe->sourceName[i]) ? pipe->sourceName[i] : '_');
+	dest[i] = '\0';
+}
+
+static float* shm_start(p2jaudio_pipe* pipe, int ringSize)
+{
+	// Build the segment name out of the pipe name
+	
+	strcpy(pipe->shmName, P2JAUDIO_SHM_PREFIX);
+	getSafeName(pipe, &pipe->shmName[strlen(P2JAUDIO_SHM_PREFIX)]);
+	
+	pipe->shmSegmentSize = P2JAUDIO_SHM_DATA_OFFSET + sizeof(float) * ringSize;
+	
+	// Readers that still have the previous segment mapped will notice its 'active' flag
+	shm_unlink(pipe->shmName);
+	
+	int fd = shm_open(pipe->shmName, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		printf ("Failed to create shared memory segment '%s': %s\n", pipe->shmName, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, pipe->shmSegmentSize) == -1) {
+		printf ("Failed to resize shared memory segment '%s': %s\n", pipe->shmName, strerror(errno));
+		close(fd);
+		shm_unlink(pipe->shmName);
+		return NULL;
+	}
+	
+	pipe->shmHeader = mmap(NULL, pipe->shmSegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pipe->shmHeader == MAP_FAILED) {
+		printf ("Failed to map shared memory segment '%s': %s\n", pipe->shmName, strerror(errno));
+		pipe->shmHeader = NULL;
+		shm_unlink(pipe->shmName);
+		return NULL;
+	}
+	
+	pipe->shmHeader->magic = P2JAUDIO_SHM_MAGIC;
+	pipe->shmHeader->version = P2JAUDIO_SHM_VERSION;
+	pipe->shmHeader->format = P2JAUDIO_SHM_FORMAT_FLOAT32;
+	pipe->shmHeader->channels = pipe->nChannels;
+	pipe->shmHeader->rate = pipe->rate;
+	pipe->shmHeader->ringSize = ringSize;
+	pipe->shmHeader->writeSize = pipe->pulseReadSize;
+	pipe->shmHeader->dataOffset = P2JAUDIO_SHM_DATA_OFFSET;
+	pipe->shmHeader->sequence = 0;
+	pipe->shmHeader->writeIndex = 0;
+	__atomic_store_n(&pipe->shmHeader->active, 1, __ATOMIC_RELEASE);
+	
+	printf ("Publishing buffer in shared memory segment '%s'.\n", pipe->shmName);
+	
+	return (float*)((char*)pipe->shmHeader + P2JAUDIO_SHM_DATA_OFFSET);
+}
+
+static void shm_beginWrite(p2jaudio_pipe* pipe)
+{
+	__atomic_store_n(&pipe->shmHeader->sequence, pipe->shmHeader->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void shm_endWrite(p2jaudio_pipe* pipe, int size)
+{
+	__atomic_store_n(&pipe->shmHeader->writeIndex, pipe->shmHeader->writeIndex + size, __ATOMIC_RELEASE);
+	__atomic_store_n(&pipe->shmHeader->sequence, pipe->shmHeader->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static int shm_stop(p2jaudio_pipe* pipe)
+{
+	if (pipe->shmHeader == NULL)
+		return 0;
+	
+	__atomic_store_n(&pipe->shmHeader->active, 0, __ATOMIC_RELEASE);
+	munmap(pipe->shmHeader, pipe->shmSegmentSize);
+	pipe->shmHeader = NULL;
+	shm_unlink(pipe->shmName);
+	
+	return 0;
+}
+
+
+static int preroll_start(p2jaudio_pipe* pipe)
+{
+	// Keep the pre-roll over restarts, unless the format changed
+	if (pipe->prerollBuffer != NULL) {
+		if (pipe->prerollRate == pipe->rate && pipe->prerollChannels == pipe->nChannels)
+			return 0;
+		printf ("Pre-roll buffer cleared, since the rate changed.\n");
+		preroll_stop(pipe);
+	}
+	
+	if (strlen(pipe->prerollFileName) == 0) {
+		strcpy(pipe->prerollFileName, "/var/tmp/p2jaudio.");
+		getSafeName(pipe, &pipe->prerollFileName[strlen(pipe->prerollFileName)]);
+		strcat(pipe->prerollFileName, ".preroll");
+	}
+	
+	pipe->prerollRate = pipe->rate;
+	pipe->prerollChannels = pipe->nChannels;
+	// In 64 bits, since a long pre-roll of many channels may not fit in the int positions of the buffer
+	const double prerollFrames = ceil(pipe->prerollTime * pipe->rate);
+	const uint64_t prerollSize = (prerollFrames > INT_MAX ? UINT64_MAX : (uint64_t)pipe->nChannels * (uint64_t)prerollFrames);
+	if (prerollSize > INT_MAX || prerollSize > SIZE_MAX / sizeof(float)) {
+		printf ("Pre-roll of %fs is too long for %d channels at %dHz, it can hold at most %d samples.\n",
+				pipe->prerollTime, pipe->nChannels, pipe->rate, INT_MAX);
+		return -1;
+	}
+	pipe->prerollSize = (int)prerollSize;
+	pipe->prerollMapSize = sizeof(float) * (size_t)prerollSize;
+	pipe->prerollWriteIndex = 0;
+	
+	int fd = open(pipe->prerollFileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		printf ("Failed to create pre-roll file '%s': %s\n", pipe->prerollFileName, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, pipe->prerollMapSize) == -1) {
+		printf ("Failed to resize pre-roll file '%s': %s\n", pipe->prerollFileName, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	// The page cache takes care of writing it back, so only the recently written pages stay in memory
+	pipe->prerollBuffer = mmap(NULL, pipe->prerollMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pipe->prerollBuffer == MAP_FAILED) {
+		printf ("Failed to map pre-roll file '%s': %s\n", pipe->prerollFileName, strerror(errno));
+		pipe->prerollBuffer = NULL;
+		return -1;
+	}
+	madvise(pipe->prerollBuffer, pipe->prerollMapSize, MADV_SEQUENTIAL);
+	
+	printf ("Keeping %fs of pre-roll in '%s'.\n", pipe->prerollTime, pipe->prerollFileName);
+	return 0;
+}
+
+/* Called from the pulse thread only */
+static void preroll_write(p2jaudio_pipe* pipe, const float* samples, int size)
+{
+	const uint64_t writeIndex = pipe->prerollWriteIndex;
+	const int offset = writeIndex % pipe->prerollSize;
+	const int firstPartSize = imin(size, pipe->prerollSize - offset);
+	
+	memcpy(&pipe->prerollBuffer[offset], samples, sizeof(float) * firstPartSize);
+	memcpy(&pipe->prerollBuffer[0], &samples[firstPartSize], sizeof(float) * (size - firstPartSize));
+	__atomic_store_n(&pipe->prerollWriteIndex, writeIndex + size, __ATOMIC_RELEASE);
+}
+
+static void writeLE16(FILE* file, int value)
+{
+	fputc(value & 0xff, file);
+	fputc((value >> 8) & 0xff, file);
+}
+static void writeLE32(FILE* file, uint32_t value)
+{
+	writeLE16(file, value & 0xffff);
+	writeLE16(file, value >> 16);
+}
+
+/* Writes the last 'time' seconds (0: all of it) of the pre-roll buffer to a new WAV file */
+static int preroll_dump(p2jaudio_pipe* pipe, double time)
+{
+	if (pipe->prerollBuffer == NULL) {
+		printf ("No pre-roll buffer to dump.\n");
+		return -1;
+	}
+	
+	// Skip the oldest part, the pulse thread keeps writing while dumping
+	
+	const uint64_t writeIndex = __atomic_load_n(&pipe->prerollWriteIndex, __ATOMIC_ACQUIRE);
+	const int marginSize = pipe->prerollChannels * (int)ceil(PREROLL_DUMP_MARGIN_TIME * pipe->prerollRate);
+	uint64_t size = writeIndex < pipe->prerollSize - marginSize ? writeIndex : pipe->prerollSize - marginSize;
+	if (time > 0 && (double)size > (double)pipe->prerollChannels * floor(time * pipe->prerollRate))
+		size = (uint64_t)pipe->prerollChannels * (uint64_t)(time * pipe->prerollRate);
+	
+	char fileName[256 + 64];
+	char timeString[32];
+	const time_t now = (time_t)getTime();
+	strftime(timeString, sizeof(timeString), "%Y%m%d-%H%M%S", localtime(&now));
+	strcpy(fileName, "p2jaudio.");
+	getSafeName(pipe, &fileName[strlen(fileName)]);
+	sprintf(&fileName[strlen(fileName)], ".%s.wav", timeString);
+	
+	FILE* file = fopen(fileName, "wb");
+	if (file == NULL) {
+		printf ("Failed to create '%s': %s\n", fileName, strerror(errno));
+		return -1;
+	}
+	
+	// WAV header, 32 bit float samples
+	
+	const uint32_t dataBytes = sizeof(float) * size;
+	fwrite("RIFF", 1, 4, file);
+	writeLE32(file, 4 + (8 + 18) + (8 + 4) + (8 + dataBytes));
+	fwrite("WAVE", 1, 4, file);
+	fwrite("fmt ", 1, 4, file);
+	writeLE32(file, 18);
+	writeLE16(file, 3);		// WAVE_FORMAT_IEEE_FLOAT
+	writeLE16(file, pipe->prerollChannels);
+	writeLE32(file, pipe->prerollRate);
+	writeLE32(file, sizeof(float) * pipe->prerollChannels * pipe->prerollRate);
+	writeLE16(file, sizeof(float) * pipe->prerollChannels);
+	writeLE16(file, 8 * sizeof(float));
+	writeLE16(file, 0);
+	fwrite("fact", 1, 4, file);
+	writeLE32(file, 4);
+	writeLE32(file, size / pipe->prerollChannels);
+	fwrite("data", 1, 4, file);
+	writeLE32(file, dataBytes);
+	
+	// Samples, straight from the mapping
+	
+	const int offset = (writeIndex - size) % pipe->prerollSize;
+	const int firstPartSize = imin(size, pipe->prerollSize - offset);
+	fwrite(&pipe->prerollBuffer[offset], sizeof(float), firstPartSize, file);
+	fwrite(&pipe->prerollBuffer[0], sizeof(float), size - firstPartSize, file);
+	
+	if (fclose(file) != 0) {
+		printf ("Failed to write '%s': %s\n", fileName, strerror(errno));
+		return -1;
+	}
+	
+	printf ("Dumped the last %fs of pre-roll to '%s'.\n", (double)size / pipe->prerollChannels / pipe->prerollRate, fileName);
+	return 0;
+}
+
+static int preroll_stop(p2jaudio_pipe* pipe)
+{
+	if (pipe->prerollBuffer == NULL)
+		return 0;
+	
+	munmap(pipe->prerollBuffer, pipe->prerollMapSize);
+	pipe->prerollBuffer = NULL;
+	unlink(pipe->prerollFileName);
+	
+	return 0;
+}
+
+
+static int trace_start(p2jaudio_pipe* pipe)
+{
+	if ((pipe->traceFile = fopen(pipe->traceFileName, "wb")) == NULL) {
+		printf ("Failed to create trace file '%s': %s\n", pipe->traceFileName, strerror(errno));
+		return -1;
+	}
+	if ((pipe->traceBuffer = malloc(sizeof(p2jaudio_trace_record) * TRACE_BUFFER_RECORDS)) == NULL) {
+		printf ("Failed to allocate the trace buffer.\n");
+		fclose(pipe->traceFile);
+		pipe->traceFile = NULL;
+		return -1;
+	}
+	
+	const p2jaudio_trace_header header = {
+		.magic = P2JAUDIO_TRACE_MAGIC,
+		.version = P2JAUDIO_TRACE_VERSION,
+		.recordSize = sizeof(p2jaudio_trace_record),
+		.launchTime = pipe->launchTime
+	};
+	fwrite(&header, sizeof(header), 1, pipe->traceFile);
+	
+	printf ("Tracing the callbacks to '%s'.\n", pipe->traceFileName);
+	return 0;
+}
+
+/* While tracing, each side holds traceMutex from its first look at the buffer until its record is written,
+   so the records are in the order in which the sides saw each other, and the trace replays exactly.
+   Otherwise neither side takes it. */
+static void trace_lock(p2jaudio_pipe* pipe)
+{
+	if (pipe->traceBuffer != NULL)
+		pthread_mutex_lock(&pipe->traceMutex);
+}
+
+static void trace_unlock(p2jaudio_pipe* pipe)
+{
+	if (pipe->traceBuffer != NULL)
+		pthread_mutex_unlock(&pipe->traceMutex);
+}
+
+/* Called while holding traceMutex, so from one thread at a time */
+static void trace_record(p2jaudio_pipe* pipe, int type, int decisions, double time, int frames, int dropFrames)
+{
+	if (pipe->traceBuffer == NULL)
+		return;
+	
+	const uint64_t writeIndex = pipe->traceWriteIndex;
+	if (writeIndex - __atomic_load_n(&pipe->traceReadIndex, __ATOMIC_ACQUIRE) >= TRACE_BUFFER_RECORDS) {
+		pipe->traceDropped++;
+		return;
+	}
+	
+	p2jaudio_trace_record* record = &pipe->traceBuffer[writeIndex % TRACE_BUFFER_RECORDS];
+	record->time = time;
+	record->type = type;
+	record->decisions = decisions;
+	record->callback.frames = frames;
+	record->callback.dropFrames = dropFrames;
+	record->callback.fill = p2jaudio_ring_fill(&pipe->pulseRing);
+	// The latency control belongs to jack, pulse doesn't read it
+	record->callback.missedFrames = (type == P2JAUDIO_TRACE_JACK ? pipe->control.missedFrames : 0);
+	record->callback.maxFrames = (type == P2JAUDIO_TRACE_JACK ? pipe->control.maxFrames : 0);
+	__atomic_store_n(&pipe->traceWriteIndex, writeIndex + 1, __ATOMIC_RELEASE);
+}
+
+/* Called while holding traceMutex, after the buffer was (re)initialised */
+static void trace_recordStart(p2jaudio_pipe* pipe)
+{
+	if (pipe->traceBuffer == NULL)
+		return;
+	
+	const uint64_t writeIndex = pipe->traceWriteIndex;
+	if (writeIndex - __atomic_load_n(&pipe->traceReadIndex, __ATOMIC_ACQUIRE) >= TRACE_BUFFER_RECORDS) {
+		pipe->traceDropped++;
+		return;
+	}
+	
+	p2jaudio_trace_record* record = &pipe->traceBuffer[writeIndex % TRACE_BUFFER_RECORDS];
+	record->time = getTime();
+	record->type = P2JAUDIO_TRACE_START;
+	record->decisions = 0;
+	record->start.rate = pipe->control.rate;
+	record->start.nChannels = pipe->control.nChannels;
+	record->start.periodSize = pipe->control.periodSize;
+	record->start.readFrames = pipe->control.readFrames;
+	record->start.bufferFrames = pipe->control.bufferFrames;
+	record->start.maxFrames = pipe->control.maxFrames;
+	record->start.benchmarkStatus = pipe->control.benchmarkStatus;
+	__atomic_store_n(&pipe->traceWriteIndex, writeIndex + 1, __ATOMIC_RELEASE);
+}
+
+/* Called from the control thread only */
+static void trace_flush(p2jaudio_pipe* pipe)
+{
+	if (pipe->traceFile == NULL)
+		return;
+	
+	const uint64_t writeIndex = __atomic_load_n(&pipe->traceWriteIndex, __ATOMIC_ACQUIRE);
+	uint64_t readIndex = pipe->traceReadIndex;
+	while (readIndex < writeIndex) {
+		const int offset = readIndex % TRACE_BUFFER_RECORDS;
+		const int n = imin(writeIndex - readIndex, TRACE_BUFFER_RECORDS - offset);
+		fwrite(&pipe->traceBuffer[offset], sizeof(p2jaudio_trace_record), n, pipe->traceFile);
+		readIndex += n;
+	}
+	__atomic_store_n(&pipe->traceReadIndex, readIndex, __ATOMIC_RELEASE);
+	fflush(pipe->traceFile);
+}
+
+static int trace_stop(p2jaudio_pipe* pipe)
+{
+	if (pipe->traceFile == NULL)
+		return 0;
+	
+	trace_flush(pipe);
+	if (pipe->traceDropped > 0)
+		printf ("Trace: %d records were dropped, since they were not written out in time.\n", pipe->traceDropped);
+	
+	const int ret = fclose(pipe->traceFile);
+	pipe->traceFile = NULL;
+	free(pipe->traceBuffer);
+	pipe->traceBuffer = NULL;
+	
+	if (ret != 0) {
+		printf ("Failed to write trace file '%s': %s\n", pipe->traceFileName, strerror(errno));
+		return -1;
+	}
+	printf ("Trace written to '%s'.\n", pipe->traceFileName);
+	return 0;
+}
+
+
+static int timeToFrames(p2jaudio_pipe* pipe, double time) {
+	return (int)ceil(pipe->rate * time);
+}
+
+static int startProcess(p2jaudio_pipe* pipe)
+{
+	printf ("Starting Process (%d*%dHz buffered in %d frames/channel)...\n", pipe->nChannels, pipe->rate, pipe->periodSize);
+	
+	if (pipe->state > -1) {
+		printf ("Process already started.\n");
+		return 0;
+	} else if (pipe->state < -1) {
+		printf ("Pipe not started yet.\n");
+		return -1;
+	}
+	
+	// The native rate of the source is known once the pre-connection got it
+	
+	if (pipe->requestedCaptureRate == -1)
+		pulse_resolveCaptureRate(pipe);
+	
+	// Update buffer
+	
+	pthread_mutex_lock(&pipe->bufferMutex);
+
+	pipe->pulsePeriodSize = pipe->nChannels * pipe->periodSize;
+	pipe->pulseReadFrames = getReadFrames(pipe, pipe->rate, pipe->periodSize);
+	
+	// When pulse is captured at another rate, each read is resampled to (at most) pulseReadFrames
+	pipe->captureRate = getCaptureRate(pipe, pipe->rate);
+	pipe->captureReadFrames = getCaptureReadFrames(pipe->captureRate, pipe->rate, pipe->pulseReadFrames);
+	pipe->captureReadSize = pipe->nChannels * pipe->captureReadFrames;
+	p2jaudio_resampler_free(pipe->resampler);
+	pipe->resampler = NULL;
+	if (pipe->captureRate != pipe->rate) {
+		if ((pipe->resampler = p2jaudio_resampler_new(pipe->captureRate, pipe->rate, pipe->nChannels, pipe->resampleQuality)) == NULL) {
+			printf ("Failed to create a resampler from %dHz to %dHz.\n", pipe->captureRate, pipe->rate);
+			pthread_mutex_unlock(&pipe->bufferMutex);
+			stop(pipe);
+			return -1;
+		}
+		pipe->pulseReadFrames = p2jaudio_resampler_maxOutFrames(pipe->resampler, pipe->captureReadFrames);
+		printf ("Resampling from %dHz to %dHz with %s quality (%d taps), which adds %fms of latency.\n",
+				pipe->captureRate, pipe->rate, p2jaudio_resample_qualityName(pipe->resampleQuality),
+				p2jaudio_resampler_taps(pipe->resampler), 1000 * p2jaudio_resampler_delay(pipe->resampler));
+	}
+	pipe->pulseReadSize = pipe->nChannels * pipe->pulseReadFrames;
+	
+	if (USE_BENCHMARK == 0 || pipe->requestedLatencyFrames > 0)
+		pipe->control.benchmarkStatus = 3;
+	
+	// Until the benchmark calibrated the buffer (in the background), a conservative latency is used
+	if (USE_BENCHMARK == 0)
+		pipe->control.maxBufferTime = PULSE_MAX_BUFFER_TIME;
+	else if (pipe->control.benchmarkStatus < 2)
+		pipe->control.maxBufferTime = CALIBRATION_BUFFER_TIME;
+	
+	const int bufferStatus = initBuffer(pipe);
+	if (bufferStatus == -1) {
+		pthread_mutex_unlock(&pipe->bufferMutex);
+		stop(pipe);
+		return -1;
+	}
+	// The progress of pulse counts from the start, like the latency control does
+	pipe->pulseFrames = 0;
+	pipe->pulseSwitches = 0;
+	trace_lock(pipe);
+	trace_recordStart(pipe);
+	trace_unlock(pipe);
+	
+	pthread_mutex_unlock(&pipe->bufferMutex);
+	
+	// The pulse thread isn't running yet, so the pre-roll buffer can be (re)created
+	
+	if (pipe->prerollTime > 0 && preroll_start(pipe) == -1) {
+		stop(pipe);
+		return -1;
+	}
+	
+	// Start pulse
+	
+	if (pulse_start(pipe, pipe->sourceName, pipe->captureRate, pipe->nChannels) == -1) {
+		stop(pipe);
+		return -1;
+	}
+	
+	// Change state
+	
+	changeState(pipe, 0);
+	printf ("Process started.\n");
+	
+	return 0;
+}
+
+static int getReadFrames(p2jaudio_pipe* pipe, int rate, int periodSize) {
+	if (pipe->requestedReadFrames > 0)
+		return pipe->requestedReadFrames;
+	else if (pipe->throughputMode)
+		return imax((int)ceil(rate * THROUGHPUT_READ_TIME), periodSize);
+	else
+		return periodSize;
+}
+
+static int getCaptureRate(p2jaudio_pipe* pipe, int rate) {
+	return pipe->requestedCaptureRate > 0 ? pipe->requestedCaptureRate : rate;
+}
+
+/* Frames to read from pulse at the capture rate, for 'readFrames' frames at the jack rate */
+static int getCaptureReadFrames(int captureRate, int rate, int readFrames) {
+	return (int)ceil((double)readFrames * captureRate / rate);
+}
+
+static int initBuffer(p2jaudio_pipe* pipe) {
+	int maxFrames;
+	if (pipe->requestedLatencyFrames > 0)
+		maxFrames = pipe->requestedLatencyFrames;
+	else
+		maxFrames = timeToFrames(pipe, pipe->control.maxBufferTime);
+	// The latency includes the room for a pulse read and a jack period, jack drops the frames above it
+	maxFrames = imax(maxFrames, pipe->periodSize + pipe->pulseReadFrames);
+	
+	// Room to be calibrated up to PULSE_MAX_BUFFER_TIME, with one pulse read and one jack period next to it
+	const int bufferFrames = imax(maxFrames, timeToFrames(pipe, PULSE_MAX_BUFFER_TIME)) + pipe->periodSize + pipe->pulseReadFrames;
+	const int bufferSize = pipe->nChannels * bufferFrames;
+	#if (DEBUG==1)
+	printf ("maxFrames set to %d, buffer size set to %d.\n", maxFrames, bufferSize);
+	#endif
+	
+	// The buffers of one pulse read, here rather than on the stack of the pulse thread,
+	// since in throughput mode they hold THROUGHPUT_READ_TIME of all channels
+	pipe->captureBuffer = malloc(sizeof(float) * pipe->captureReadSize);
+	pipe->switchBuffer = malloc(sizeof(float) * pipe->captureReadSize);
+	pipe->resampleBuffer = (pipe->resampler != NULL ? malloc(sizeof(float) * pipe->pulseReadSize) : NULL);
+	if (pipe->captureBuffer == NULL || pipe->switchBuffer == NULL || (pipe->resampler != NULL && pipe->resampleBuffer == NULL)) {
+		printf ("Failed to allocate the buffers of a pulse read of %d frames.\n", pipe->captureReadFrames);
+		freeBuffer(pipe);
+		return -1;
+	}
+	
+	float* buffer;
+	if (pipe->useShm)
+		buffer = shm_start(pipe, bufferSize);
+	else
+		buffer = malloc(sizeof(float) * bufferSize);
+	if (buffer == NULL) {
+		printf ("Failed to allocate new buffer size = %dB.\n", (int)sizeof(float) * bufferSize);
+		freeBuffer(pipe);
+		return -1;
+	}
+	
+	// Init variables
+	
+	p2jaudio_ring_init(&pipe->pulseRing, buffer, bufferSize);
+	p2jaudio_control_init(&pipe->control, pipe->rate, pipe->nChannels, pipe->periodSize, pipe->pulseReadFrames, bufferFrames, maxFrames);
+	
+	return 0;
+}
+
+static void freeBuffer(p2jaudio_pipe* pipe) {
+	free(pipe->captureBuffer);
+	pipe->captureBuffer = NULL;
+	free(pipe->switchBuffer);
+	pipe->switchBuffer = NULL;
+	free(pipe->resampleBuffer);
+	pipe->resampleBuffer = NULL;
+	
+	if (pipe->pulseRing.buffer == NULL)
+		return;
+	
+	if (pipe->useShm)
+		shm_stop(pipe);
+	else
+		free(pipe->pulseRing.buffer);
+	pipe->pulseRing.buffer = NULL;
+}
+
+static int stopProcess(p2jaudio_pipe* pipe)
+{
+	printf ("Process stopping...\n");
+	
+	if (pipe->state <= -1) {
+		printf ("Process already stopped.\n");
+		return 0;
+	}
+	
+	// Change state
+	
+	changeState(pipe, -1);
+	
+	// Stop pulse first, since it writes to the buffer without taking bufferMutex,
+	// the resampler is only used by its thread
+	
+	pulse_stop(pipe);
+	p2jaudio_resampler_free(pipe->resampler);
+	pipe->resampler = NULL;
+	
+	// Free buffer, once the process callback is done with it
+	pthread_mutex_lock(&pipe->bufferMutex);
+	if (pipe->todo != 0)
+		pipe->control.benchmarkStatus = -1;
+	freeBuffer(pipe);
+	pthread_mutex_unlock(&pipe->bufferMutex);
+	printf ("Process stopped.\n");
+	
+	return 0;
+}
+
+
+static void changeState(p2jaudio_pipe* pipe, int newState) {
+	PROBE2(state_change, pipe->state, newState);
+	__atomic_store_n(&pipe->state, newState, __ATOMIC_RELEASE);
+}
+
+/* For the handshake of both sides: changes the state from 'oldState' to 'newState',
+   unless another thread changed it in the meantime, returns whether it did. */
+static int advanceState(p2jaudio_pipe* pipe, int oldState, int newState) {
+	if (!__atomic_compare_exchange_n(&pipe->state, &oldState, newState, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return 0;
+	PROBE2(state_change, oldState, newState);
+	return 1;
+}
+
+static int changeTodo(p2jaudio_pipe* pipe, int newTodo) {
+	pthread_mutex_lock(&pipe->todoMutex);
+	PROBE2(todo_change, pipe->todo, imax(newTodo, pipe->todo));
+	__atomic_store_n(&pipe->todo, imax(newTodo, pipe->todo), __ATOMIC_RELEASE);
+	#if (DEBUG==1)
+	printf ("todo change: %d.\n", pipe->todo);
+	#endif
+	pthread_mutex_unlock(&pipe->todoMutex);
+	wakeup(pipe);
+	return 0;
+}
+
+static int restartProcess(p2jaudio_pipe* pipe) {
+	return changeTodo(pipe, 1);
+}
+
+/* Connects pulse while the application starts, assuming its rate, before the single deadline taken at launch.
+   With '-R native', the rate of the source is queried by the connection as well. */
+static void start(p2jaudio_pipe* pipe)
+{
+	pipe->startupDeadline = pipe->launchTime + pipe->startupTimeout;
+	const int expectedCaptureRate = (pipe->requestedCaptureRate == -1 ? -1 : getCaptureRate(pipe, EXPECTED_RATE));
+	const int fragmentFrames = getReadFrames(pipe, EXPECTED_RATE, PRECONNECT_PERIOD_SIZE);
+	pipe->pulsePreconnection = pulse_connect(pipe->sourceName, pipe->sourceDevice, expectedCaptureRate, pipe->nChannels,
+			expectedCaptureRate == -1 ? fragmentFrames : getCaptureReadFrames(expectedCaptureRate, EXPECTED_RATE, fragmentFrames),
+			pipe->startupDeadline);
+}
+
+static int stop(p2jaudio_pipe* pipe)
+{
+	return changeTodo(pipe, 2);
+}
+
+
+/* The control thread sleeps on a semaphore, so any thread can wake it up */
+static int waitForWakeup(p2jaudio_pipe* pipe, double timeout) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += (time_t)timeout;
+	deadline.tv_nsec += (long)((timeout - (time_t)timeout) * 1000000000);
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	
+	while (sem_timedwait(&pipe->waiterSem, &deadline) == -1)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+static void wakeup(p2jaudio_pipe* pipe) {
+	sem_post(&pipe->waiterSem);
+}
+
+
+/* Handles the requests to the pipe, and writes out the trace, until the pipe stops */
+static void* control_run(void* arg)
+{
+	p2jaudio_pipe* pipe = arg;
+	int firstAudioReported = 0;
+	
+	for (;;) {
+		waitForWakeup(pipe, WAIT_INTERVAL);
+		
+		pipe_printControlMessages(pipe);
+		
+		pthread_mutex_lock(&pipe->todoMutex);
+		const int dump = pipe->dumpRequested;
+		const int doSwitch = pipe->switchRequested;
+		char device[MAX_DEVICE_LENGTH];
+		strcpy(device, pipe->requestedSourceDevice);
+		pipe->dumpRequested = 0;
+		pipe->switchRequested = 0;
+		pthread_mutex_unlock(&pipe->todoMutex);
+		
+		if (dump)
+			preroll_dump(pipe, pipe->prerollDumpTime);
+		
+		pulse_freeRetired(pipe);
+		if (doSwitch)
+			pulse_switch(pipe, device);
+		
+		trace_flush(pipe);
+		
+		if (!firstAudioReported && pipe->firstAudioTime != 0) {
+			printf ("First audio after %fms since launch.\n", 1000 * (pipe->firstAudioTime - pipe->launchTime));
+			firstAudioReported = 1;
+		}
+
+		pthread_mutex_lock(&pipe->processMutex);
+		pthread_mutex_lock(&pipe->todoMutex);
+		if (pipe->todo > -1) {
+			pthread_mutex_unlock(&pipe->todoMutex);
+			stopProcess(pipe);
+			pthread_mutex_lock(&pipe->todoMutex);
+		}
+		if (pipe->todo == 0 || pipe->todo == 1) {
+			#if (DEBUG==1)
+			printf ("Got restart type %d.\n", pipe->todo);
+			#endif
+			PROBE2(todo_change, pipe->todo, -1);
+			__atomic_store_n(&pipe->todo, -1, __ATOMIC_RELEASE);
+			pipe->rate = pipe->newRate;
+			pipe->periodSize = pipe->newPeriodSize;
+			pthread_mutex_unlock(&pipe->todoMutex);
+			printf ("Restarting Process...\n");
+			pipe->startupDeadline = getTime() + pipe->startupTimeout;
+			if (startProcess(pipe) == -1)
+				stop(pipe);
+			else
+				printf ("Process restarted.\n");
+		} else if (pipe->todo == 2) {
+			#if (DEBUG==1)
+			printf ("Got stop.\n");
+			#endif
+			pthread_mutex_unlock(&pipe->todoMutex);
+			changeState(pipe, -2);
+			preroll_stop(pipe);
+			trace_stop(pipe);
+			pthread_mutex_unlock(&pipe->processMutex);
+			break;
+		} else
+			pthread_mutex_unlock(&pipe->todoMutex);
+		pthread_mutex_unlock(&pipe->processMutex);
+	}
+	
+	// E.g. the shutdown after too frequent buffer underruns
+	pipe_printControlMessages(pipe);
+	__atomic_store_n(&pipe->running, 0, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+
+/* Copies 'src' (NULL: empty) to 'dest' of 'size' bytes, returns -1 when it's too long */
+static int copyOption(char* dest, const char* src, size_t size, const char* what)
+{
+	if (src == NULL)
+		src = "";
+	if (strlen(src) >= size) {
+		printf ("The %s is too long.\n", what);
+		return -1;
+	}
+	strcpy(dest, src);
+	return 0;
+}
+
+void p2jaudio_options_init(p2jaudio_options* options)
+{
+	memset(options, 0, sizeof(p2jaudio_options));
+	options->name = "p2jaudio";
+	options->nChannels = 2;
+	options->resampleQuality = P2JAUDIO_RESAMPLE_HIGH;
+	options->timeout = STARTUP_TIMEOUT;
+}
+
+/* Allocates a pipe, aligned to the cache lines its fields are grouped in */
+static p2jaudio_pipe* pipe_alloc()
+{
+	p2jaudio_pipe* pipe;
+	if (posix_memalign((void**)&pipe, CACHE_LINE_SIZE, sizeof(p2jaudio_pipe)) != 0)
+		return NULL;
+	memset(pipe, 0, sizeof(p2jaudio_pipe));
+	
+	pthread_mutex_init(&pipe->bufferMutex, NULL);
+	pthread_mutex_init(&pipe->traceMutex, NULL);
+	pthread_mutex_init(&pipe->pulseMutex, NULL);
+	pthread_mutex_init(&pipe->todoMutex, NULL);
+	pthread_mutex_init(&pipe->processMutex, NULL);
+	sem_init(&pipe->waiterSem, 0, 0);
+	return pipe;
+}
+
+static void pipe_dealloc(p2jaudio_pipe* pipe)
+{
+	pthread_mutex_destroy(&pipe->bufferMutex);
+	pthread_mutex_destroy(&pipe->traceMutex);
+	pthread_mutex_destroy(&pipe->pulseMutex);
+	pthread_mutex_destroy(&pipe->todoMutex);
+	pthread_mutex_destroy(&pipe->processMutex);
+	sem_destroy(&pipe->waiterSem);
+	free(pipe);
+}
+
+p2jaudio_pipe* p2jaudio_pipe_new(const p2jaudio_options* options)
+{
+	if (options->nChannels <= 0 || options->timeout <= 0 ||
+			(options->prerollTime > 0 && options->prerollTime < P2JAUDIO_MIN_PREROLL_TIME) ||
+			options->resampleQuality < 0 || options->resampleQuality >= P2JAUDIO_RESAMPLE_QUALITIES) {
+		printf ("Invalid options for the pipe.\n");
+		return NULL;
+	}
+	
+	p2jaudio_pipe* pipe;
+	if ((pipe = pipe_alloc()) == NULL) {
+		printf ("Failed to allocate the pipe.\n");
+		return NULL;
+	}
+	if (copyOption(pipe->sourceName, options->name, sizeof(pipe->sourceName), "name") == -1 ||
+			copyOption(pipe->sourceDevice, options->device, sizeof(pipe->sourceDevice), "source device name") == -1 ||
+			copyOption(pipe->prerollFileName, options->prerollFile, sizeof(pipe->prerollFileName), "pre-roll file name") == -1 ||
+			copyOption(pipe->traceFileName, options->traceFile, sizeof(pipe->traceFileName), "trace file name") == -1) {
+		pipe_dealloc(pipe);
+		return NULL;
+	}
+	
+	pipe->nChannels = options->nChannels;
+	pipe->requestedLatencyFrames = options->latencyFrames;
+	pipe->requestedReadFrames = options->readFrames;
+	pipe->throughputMode = options->throughput;
+	pipe->requestedCaptureRate = options->captureRate;
+	pipe->resampleQuality = options->resampleQuality;
+	pipe->useShm = options->shm;
+	pipe->prerollTime = options->prerollTime;
+	pipe->prerollDumpTime = options->prerollDumpTime;
+	pipe->startupTimeout = options->timeout;
+	
+	pipe->launchTime = getTime();
+	pipe->control.benchmarkStatus = -1;
+	pipe->state = -2;
+	pipe->todo = -1;
+	
+	if (strlen(pipe->traceFileName) > 0 && trace_start(pipe) == -1) {
+		pipe_dealloc(pipe);
+		return NULL;
+	}
+	
+	start(pipe);
+	
+	pipe->running = 1;
+	if (pthread_create(&pipe->controlThread, NULL, control_run, pipe) != 0) {
+		printf ("Failed to create the control thread.\n");
+		pulse_abandon(pipe->pulsePreconnection);
+		pipe->pulsePreconnection = NULL;
+		trace_stop(pipe);
+		pipe_dealloc(pipe);
+		return NULL;
+	}
+	return pipe;
+}
+
+int p2jaudio_pipe_start(p2jaudio_pipe* pipe, int r, int b)
+{
+	pthread_mutex_lock(&pipe->processMutex);
+	pthread_mutex_lock(&pipe->todoMutex);
+	pipe->rate = pipe->newRate = r;
+	pipe->periodSize = pipe->newPeriodSize = b;
+	pthread_mutex_unlock(&pipe->todoMutex);
+	
+	int ret = -1;
+	if (pipe->state == -2) {
+		changeState(pipe, -1);
+		ret = startProcess(pipe);
+	} else
+		printf ("Pipe already started.\n");
+	
+	pulse_abandon(pipe->pulsePreconnection);
+	pipe->pulsePreconnection = NULL;
+	pthread_mutex_unlock(&pipe->processMutex);
+	
+	if (ret == -1)
+		stop(pipe);
+	return ret;
+}
+
+/* Called by the application from its own thread, the control thread reads the new values under todoMutex */
+void p2jaudio_pipe_setRate(p2jaudio_pipe* pipe, int r)
+{
+	pthread_mutex_lock(&pipe->todoMutex);
+	const int changed = (pipe->newRate != r);
+	pipe->newRate = r;
+	pthread_mutex_unlock(&pipe->todoMutex);
+	
+	// Before the pipe is started, p2jaudio_pipe_start() gets it anyway
+	if (changed && pipe->state > -2) {
+		printf ("Rate changed to %d.\n", r);
+		restartProcess(pipe);
+	}
+}
+
+void p2jaudio_pipe_setPeriodSize(p2jaudio_pipe* pipe, int b)
+{
+	pthread_mutex_lock(&pipe->todoMutex);
+	const int changed = (pipe->newPeriodSize != b);
+	pipe->newPeriodSize = b;
+	pthread_mutex_unlock(&pipe->todoMutex);
+	
+	// Before the pipe is started, p2jaudio_pipe_start() gets it anyway
+	if (changed && pipe->state > -2) {
+		printf ("Period Size changed to %d.\n", b);
+		restartProcess(pipe);
+	}
+}
+
+void p2jaudio_pipe_switchSource(p2jaudio_pipe* pipe, const char* device)
+{
+	pthread_mutex_lock(&pipe->todoMutex);
+	if (copyOption(pipe->requestedSourceDevice, device, sizeof(pipe->requestedSourceDevice), "source device name") == 0)
+		pipe->switchRequested = 1;
+	pthread_mutex_unlock(&pipe->todoMutex);
+	wakeup(pipe);
+}
+
+void p2jaudio_pipe_dump(p2jaudio_pipe* pipe)
+{
+	pthread_mutex_lock(&pipe->todoMutex);
+	pipe->dumpRequested = 1;
+	pthread_mutex_unlock(&pipe->todoMutex);
+	wakeup(pipe);
+}
+
+void p2jaudio_pipe_stop(p2jaudio_pipe* pipe)
+{
+	stop(pipe);
+}
+
+int p2jaudio_pipe_isRunning(p2jaudio_pipe* pipe)
+{
+	return __atomic_load_n(&pipe->running, __ATOMIC_ACQUIRE);
+}
+
+void p2jaudio_pipe_free(p2jaudio_pipe* pipe)
+{
+	stop(pipe);
+	pthread_join(pipe->controlThread, NULL);
+	pulse_abandon(pipe->pulsePreconnection);
+	pipe->pulsePreconnection = NULL;
+	
+	const double wallTime = getTime() - pipe->launchTime;
+	if (pipe->resampledFrames > 0)
+		printf ("Of which resampling (%s quality): %f%%, so %f%% per channel (%fns per frame).\n",
+				p2jaudio_resample_qualityName(pipe->resampleQuality), 100 * pipe->resampleTime / wallTime,
+				100 * pipe->resampleTime / wallTime / pipe->nChannels, 1e9 * pipe->resampleTime / pipe->resampledFrames);
+	
+	pipe_dealloc(pipe);
+}
@@ -0,0 +1,240 @@
+/**
+
+Name: p2jaudio_pipe.h
+Description: Layout of a pipe (opaque in 'p2jaudio.h'), private to libp2jaudio and its benchmark,
+and the two steps through which the pulse thread (the producer) and the process callback
+of the application (the consumer) exchange the audio, without a shared lock:
+pulse writes the ring and publishes its progress, jack catches up on it in the latency control.
+The pulse types are only referred to by pointer, so this header doesn't need the pulse headers.
+
+**/
+
+#ifndef P2JAUDIO_PIPE_H
+#define P2JAUDIO_PIPE_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "p2jaudio.h"
+#include "p2jaudio_ring.h"
+#include "p2jaudio_control.h"
+#include "p2jaudio_trace.h"
+#include "p2jaudio_resample.h"
+#include "p2jaudio_shm.h"
+
+
+/* Maximum length of the name of a source device */
+#define MAX_DEVICE_LENGTH 256
+
+/* Messages of the latency control on their way to the control thread */
+#define MAX_CONTROL_MESSAGES 8
+
+typedef struct pulseConnection pulseConnection;
+
+
+/* A pipe, its fields are grouped in cache lines by the threads that write them:
+   the pulse thread (the producer) and the process callback of the application (the consumer)
+   run on different cores, so a line written by one of them every period, that the other one reads,
+   moves between both cores every period. No line is written by both every period,
+   each period the consumer reads two lines of the producer (the write index of the ring and its progress),
+   and the producer only reads the read index of the ring when the ring looks full. */
+struct p2jaudio_pipe {
+	
+	/* Read by both sides every period, only written by the control thread while (re)starting,
+	   when neither side runs */
+	
+	int				rate CACHE_ALIGNED;
+	int				periodSize;
+	int				nChannels;
+	
+	/* Sizes ending in 'Size' count interleaved samples (frames * nChannels),
+	   so do the positions in pulseRing (see 'p2jaudio_ring.h').
+	   Sizes ending in 'Frames' count frames per channel. */
+	int				pulsePeriodSize;
+	int				pulseReadFrames;
+	int				pulseReadSize;
+	
+	/* Rate at which pulse is captured, when it differs from the jack rate, the pulse thread resamples it
+	   (see 'p2jaudio_resample.h') */
+	int				captureRate;
+	int				captureReadFrames;
+	int				captureReadSize;
+	p2jaudio_resampler*	resampler;
+	
+	/* Whether the buffer is published in a shared-memory segment, see 'p2jaudio_shm.h' */
+	int				useShm;
+	p2jaudio_shm_header*	shmHeader;
+	
+	/* Optional long ring of the captured audio in a memory-mapped file, dumped to a WAV file on request */
+	float*			prerollBuffer;
+	int				prerollSize;
+	
+	/* Optional binary trace of the callbacks, see 'p2jaudio_trace.h'.
+	   The callbacks record into a ring (while holding traceMutex), the control thread writes it to the file. */
+	p2jaudio_trace_record*	traceBuffer;
+	
+	/* Read by both sides every period, written a few times per (re)start */
+	
+	/* state, both sides advance it with a compare-and-swap, the control thread sets it
+		-2: both sides not initialized yet (the pipe is not started by the application yet).
+		-1: process not initialized yet.
+		0: everything initialized, but no signals of both sides received yet.
+		1: received signal of jack but not of pulse in this state.
+		2: received signal of pulse while in state 1, this is either the benchmarking state or the common operating state.
+		In this way, with this 'handshake', we try to start syncronised.
+	*/
+	int				state CACHE_ALIGNED;
+	
+	/* todo, written under todoMutex, the callbacks only read it
+		-1: just proceed through the functions and callbacks as normal.
+		0: soft-restart the process, by skipping benchmarking.
+		1: restart the process.
+		2: stop the process and quit.
+	*/
+	int				todo;
+	
+	/* Written by the process callback of the application only.
+	   bufferMutex is held by it while it reads, and by the control thread while it (re)creates the buffer,
+	   not by the pulse thread. */
+	
+	pthread_mutex_t	bufferMutex CACHE_ALIGNED;
+	
+	/* Latency control of the buffer, see 'p2jaudio_control.h' */
+	p2jaudio_control	control;
+	
+	double			firstAudioTime;
+	
+	/* The messages of the latency control, jack doesn't print in its realtime thread, the control thread does */
+	p2jaudio_control_message	controlMessages[MAX_CONTROL_MESSAGES];
+	uint64_t		controlMessageWriteIndex;
+	
+	/* The ring between both sides, its write and read index are on lines of their own */
+	
+	p2jaudio_ring	pulseRing;
+	
+	/* Written by the pulse thread every read, after writing the ring: its progress, for the latency control */
+	
+	long long		pulseFrames CACHE_ALIGNED;
+	int				pulseSwitches;
+	
+	/* Written by both sides every period, only when tracing: then traceMutex keeps the order
+	   of the records the same as the order of the ring operations, so the trace can be replayed exactly */
+	
+	pthread_mutex_t	traceMutex CACHE_ALIGNED;
+	uint64_t		traceWriteIndex;
+	int				traceDropped;
+	
+	/* Written by the pulse thread every read */
+	
+	pthread_mutex_t	pulseMutex CACHE_ALIGNED;
+	struct pa_simple*	pulseStream;
+	
+	/* Switching to another source without restarting, under pulseMutex:
+	   the pulse thread reads both streams and crossfades from pulseStream to pulseSwitchStream,
+	   then hands the old stream to the control thread to free it, since pa_simple_free() may block. */
+	struct pa_simple*	pulseSwitchStream;
+	int				pulseSwitchFrames;
+	int				pulseSwitchTotalFrames;
+	struct pa_simple*	pulseRetiredStream;
+	
+	/* The buffers of one read, allocated with the ring, since in throughput mode they are too large for the stack */
+	float*			captureBuffer;
+	float*			switchBuffer;
+	float*			resampleBuffer;
+	
+	double			resampleTime;
+	long long		resampledFrames;
+	uint64_t		prerollWriteIndex;
+	
+	/* The pulse server thread is only started and stopped from the process functions, under processMutex,
+	   stopping joins it, so it's never running twice. */
+	pthread_t		pulseServerThread;
+	int				pulseRunning;
+	int				(*pulseServer_processCb)(p2jaudio_pipe* pipe);
+	
+	char			pulseSwitchDevice[MAX_DEVICE_LENGTH];
+	
+	/* Written by the application and the control thread, on requests and (re)starts */
+	
+	pthread_mutex_t	todoMutex CACHE_ALIGNED;
+	
+	/* Held while (re)starting or stopping the process, which the application and the control thread both do */
+	pthread_mutex_t	processMutex;
+	
+	/* The control thread of the pipe wakes up on waiterSem */
+	sem_t			waiterSem;
+	pthread_t		controlThread;
+	int				running;
+	
+	int				newRate;
+	int				newPeriodSize;
+	
+	/* Messages of the latency control printed by the control thread, see controlMessages */
+	uint64_t		controlMessageReadIndex;
+	
+	/* Requests handed to the control thread, under todoMutex */
+	char			requestedSourceDevice[MAX_DEVICE_LENGTH];
+	int				switchRequested;
+	int				dumpRequested;
+	
+	char			sourceName[256];
+	
+	/* Source device pulse records from, empty means: $PULSE_SOURCE or the default source */
+	char			sourceDevice[MAX_DEVICE_LENGTH];
+	
+	/* Set by the options, 0 means: derive it (from the period size or the benchmark). */
+	int				requestedReadFrames;
+	int				requestedLatencyFrames;
+	
+	/* Whether pulse is read in large batches (THROUGHPUT_READ_TIME), instead of per jack period */
+	int				throughputMode;
+	
+	/* Set by the options, 0 means: the jack rate, -1: the native rate of the source. */
+	int				requestedCaptureRate;
+	int				resampleQuality;
+	
+	size_t			shmSegmentSize;
+	char			shmName[256 + sizeof(P2JAUDIO_SHM_PREFIX)];
+	
+	double			prerollTime;
+	double			prerollDumpTime;
+	char			prerollFileName[256 + 32];
+	size_t			prerollMapSize;
+	int				prerollRate;
+	int				prerollChannels;
+	
+	char			traceFileName[256];
+	FILE*			traceFile;
+	uint64_t		traceReadIndex;
+	
+	/* Startup: pulse connects while the application starts, before 'startupDeadline' */
+	double			launchTime;
+	double			startupTimeout;
+	double			startupDeadline;
+	
+	/* Connection started before the pipe was, at the expected rate */
+	pulseConnection*	pulsePreconnection;
+};
+
+
+/* Pulse: writes the 'frames' frames of a read to the ring, then publishes them (and whether the read
+   completed a switch of source) to the latency control. Returns the amount of samples dropped,
+   since the ring was full. */
+static inline int p2jaudio_pipe_publishRead(p2jaudio_pipe* pipe, const float* samples, int frames, int switched) {
+	const int overflow = p2jaudio_ring_write(&pipe->pulseRing, samples, pipe->nChannels * frames);
+	if (switched)
+		__atomic_store_n(&pipe->pulseSwitches, pipe->pulseSwitches + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&pipe->pulseFrames, pipe->pulseFrames + frames, __ATOMIC_RELEASE);
+	return overflow;
+}
+
+/* Jack, under bufferMutex: runs the latency control for a period of 'frames' frames,
+   after catching up on what pulse published, see p2jaudio_control_jack(). */
+static inline int p2jaudio_pipe_controlPeriod(p2jaudio_pipe* pipe, int frames, double now, int* dropFrames) {
+	const long long pulseFrames = __atomic_load_n(&pipe->pulseFrames, __ATOMIC_ACQUIRE);
+	const int pulseSwitches = __atomic_load_n(&pipe->pulseSwitches, __ATOMIC_ACQUIRE);
+	return p2jaudio_control_jack(&pipe->control, &pipe->pulseRing, frames, pulseFrames, pulseSwitches, now, dropFrames);
+}
+
+#endif
@@ -0,0 +1,44 @@
+/**
+
+Name: p2jaudio_probes.h
+Description: Static tracepoints (USDT probes) of p2jaudio, for use with perf, bpftrace or systemtap.
+They are only compiled in when HAVE_SYS_SDT_H is defined (the Makefile does this when
+'sys/sdt.h' is installed), and then cost a single 'nop' instruction when nothing is attached.
+Their arguments are values the code computed anyway, so they add no work (e.g. no loads of the
+cache lines of the other side of the ring), also when compiled without them.
+All probes belong to the provider 'p2jaudio', e.g. list them with:
+	bpftrace -l 'usdt:./p2jaudio:p2jaudio:*'
+
+Probe                   Arguments
+jack_process_entry      frames
+jack_process_exit       return value
+pulse_process_entry     pulseReadFrames
+pulse_process_exit      return value, fill of the ring as far as pulse knows (at least the real fill)
+ring_read               fill of the ring (before reading, as the latency control saw it), missedFrames
+ring_write              fill of the ring (after writing, as far as pulse knows), frames written by pulse since the (re)start
+ring_underrun           fill of the ring (less than the period, so the last period is repeated)
+ring_overflow           amount of samples dropped, since the ring was full
+ring_drop               frames dropped (crossfaded) in this period, to reduce the latency
+underrun                side (0: jack, 1: pulse), missedFrames, bufferUnderrunAmount
+state_change            old state, new state
+todo_change             old todo, new todo
+
+**/
+
+#ifndef P2JAUDIO_PROBES_H
+#define P2JAUDIO_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+	#include <sys/sdt.h>
+	#define PROBE0(name)			DTRACE_PROBE(p2jaudio, name)
+	#define PROBE1(name, a)			DTRACE_PROBE1(p2jaudio, name, a)
+	#define PROBE2(name, a, b)		DTRACE_PROBE2(p2jaudio, name, a, b)
+	#define PROBE3(name, a, b, c)	DTRACE_PROBE3(p2jaudio, name, a, b, c)
+#else
+	#define PROBE0(name)			do {} while (0)
+	#define PROBE1(name, a)			do { (void)(a); } while (0)
+	#define PROBE2(name, a, b)		do { (void)(a); (void)(b); } while (0)
+	#define PROBE3(name, a, b, c)	do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,247 @@
+/**
+
+Name: p2jaudio_resample.c
+Description: Polyphase resampler of p2jaudio, see 'p2jaudio_resample.h'.
+The filter is applied with GCC vector extensions, so it uses SIMD instructions
+on every architecture GCC has them for, without architecture specific code.
+
+**/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "p2jaudio_resample.h"
+
+
+/* Floats per SIMD vector, the taps of each phase are padded to a multiple of it */
+#define VECTOR_SIZE 8
+
+/* Input frames deinterleaved into the history at once */
+#define CHUNK_FRAMES 1024
+
+typedef float vfloat __attribute__((vector_size(VECTOR_SIZE * sizeof(float))));
+typedef float vfloat_u __attribute__((vector_size(VECTOR_SIZE * sizeof(float)), aligned(sizeof(float)), may_alias));
+
+static const struct {
+	const char*	name;
+	int			taps;
+	double		cutoff;		/* passband, relative to the Nyquist frequency of the lowest rate */
+	double		beta;		/* of the Kaiser window */
+} qualities[P2JAUDIO_RESAMPLE_QUALITIES] = {
+	{"low",		8,	0.80,	5.0},
+	{"medium",	16,	0.88,	7.0},
+	{"high",	32,	0.93,	8.6},
+	{"best",	64,	0.96,	10.0},
+};
+
+struct p2jaudio_resampler {
+	int		inRate;
+	int		nChannels;
+	int		phases;			/* L: the output rate divided by the gcd */
+	int		step;			/* M: the input rate divided by the gcd */
+	int		taps;
+	double	delay;			/* in frames at the upsampled rate (so the input rate times L) */
+
+	/* phases * taps, each phase reversed, so it's applied forward on the history */
+	float*	coefficients;
+
+	/* Planar, historyFrames per channel, starting with the last taps-1 frames of the previous call */
+	float*	history;
+	int		historyFrames;
+	int		filled;
+
+	/* Next output: first input frame in the history, and phase */
+	int		start;
+	int		phase;
+};
+
+
+static int gcd(int a, int b) {
+	while (b != 0) {
+		const int r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+/* Modified Bessel function of the first kind, of order 0 */
+static double bessel_i0(double x) {
+	double sum = 1, term = 1;
+	int k;
+	for (k = 1; k < 50 && term > 1e-12 * sum; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static void createFilter(p2jaudio_resampler* resampler, int quality) {
+	const int L = resampler->phases;
+	const int taps = resampler->taps;
+	const int length = L * taps;
+	const double center = (length - 1) / 2.0;
+	// Cutoff at the upsampled rate, in cycles per sample
+	const double fc = 0.5 * qualities[quality].cutoff / (L > resampler->step ? L : resampler->step);
+	const double beta = qualities[quality].beta;
+	int p, j;
+
+	for (p = 0; p < L; p++) {
+		float* phase = &resampler->coefficients[p * taps];
+		double sum = 0;
+		for (j = 0; j < taps; j++) {
+			const int i = (taps - 1 - j) * L + p;
+			const double x = i - center;
+			const double sinc = (x == 0 ? 1 : sin(2 * M_PI * fc * x) / (2 * M_PI * fc * x));
+			const double r = 2 * i / (double)(length - 1) - 1;
+			const double window = bessel_i0(beta * sqrt(fmax(1 - r * r, 0))) / bessel_i0(beta);
+			phase[j] = sinc * window;
+			sum += phase[j];
+		}
+		// Unity gain at DC for each phase
+		for (j = 0; j < taps; j++)
+			phase[j] /= sum;
+	}
+
+	resampler->delay = center;
+}
+
+p2jaudio_resampler* p2jaudio_resampler_new(int inRate, int outRate, int nChannels, int quality) {
+	if (inRate <= 0 || outRate <= 0 || nChannels <= 0 || quality < 0 || quality >= P2JAUDIO_RESAMPLE_QUALITIES)
+		return NULL;
+
+	const int divisor = gcd(inRate, outRate);
+	if (outRate / divisor > P2JAUDIO_RESAMPLE_MAX_PHASES)
+		return NULL;
+
+	p2jaudio_resampler* resampler = calloc(1, sizeof(p2jaudio_resampler));
+	if (resampler == NULL)
+		return NULL;
+	resampler->inRate = inRate;
+	resampler->nChannels = nChannels;
+	resampler->phases = outRate / divisor;
+	resampler->step = inRate / divisor;
+
+	// When downsampling, the cutoff is lowered, so the filter needs to be longer for the same steepness
+	int taps = qualities[quality].taps;
+	if (resampler->step > resampler->phases)
+		taps = (int)ceil((double)taps * resampler->step / resampler->phases);
+	resampler->taps = (taps + VECTOR_SIZE - 1) / VECTOR_SIZE * VECTOR_SIZE;
+
+	resampler->historyFrames = resampler->taps + CHUNK_FRAMES;
+	if (posix_memalign((void**)&resampler->coefficients, sizeof(vfloat),
+				sizeof(float) * resampler->phases * resampler->taps) != 0) {
+		free(resampler);
+		return NULL;
+	}
+	if ((resampler->history = calloc(nChannels * resampler->historyFrames, sizeof(float))) == NULL) {
+		free(resampler->coefficients);
+		free(resampler);
+		return NULL;
+	}
+
+	createFilter(resampler, quality);
+
+	// Start with silence in front of the first input frame
+	resampler->filled = resampler->taps - 1;
+	resampler->start = 0;
+	resampler->phase = 0;
+
+	return resampler;
+}
+
+void p2jaudio_resampler_free(p2jaudio_resampler* resampler) {
+	if (resampler == NULL)
+		return;
+	free(resampler->coefficients);
+	free(resampler->history);
+	free(resampler);
+}
+
+int p2jaudio_resampler_maxOutFrames(const p2jaudio_resampler* resampler, int inFrames) {
+	return (int)(((long long)inFrames * resampler->phases + resampler->step - 1) / resampler->step) + 1;
+}
+
+double p2jaudio_resampler_delay(const p2jaudio_resampler* resampler) {
+	return resampler->delay / resampler->phases / resampler->inRate;
+}
+
+int p2jaudio_resampler_taps(const p2jaudio_resampler* resampler) {
+	return resampler->taps;
+}
+
+static inline float dot(const float* coefficients, const float* samples, int taps) {
+	vfloat sum = {0};
+	int j;
+	for (j = 0; j < taps; j += VECTOR_SIZE)
+		sum += *(const vfloat*)&coefficients[j] * *(const vfloat_u*)&samples[j];
+
+	float result = 0;
+	for (j = 0; j < VECTOR_SIZE; j++)
+		result += sum[j];
+	return result;
+}
+
+int p2jaudio_resampler_process(p2jaudio_resampler* resampler, const float* in, int inFrames, float* out) {
+	const int nChannels = resampler->nChannels;
+	const int taps = resampler->taps;
+	const int L = resampler->phases;
+	const int M = resampler->step;
+	int outFrames = 0;
+	int i, j;
+
+	while (inFrames > 0) {
+		// Append a chunk to the history
+
+		const int frames = (inFrames < CHUNK_FRAMES ? inFrames : CHUNK_FRAMES);
+		for (i = 0; i < nChannels; i++) {
+			float* history = &resampler->history[i * resampler->historyFrames + resampler->filled];
+			for (j = 0; j < frames; j++)
+				history[j] = in[j * nChannels + i];
+		}
+		resampler->filled += frames;
+		in += nChannels * frames;
+		inFrames -= frames;
+
+		// Filter, as long as the history holds all taps
+
+		while (resampler->start + taps <= resampler->filled) {
+			const float* phase = &resampler->coefficients[resampler->phase * taps];
+			for (i = 0; i < nChannels; i++)
+				out[i] = dot(phase, &resampler->history[i * resampler->historyFrames + resampler->start], taps);
+			out += nChannels;
+			outFrames++;
+
+			resampler->phase += M;
+			resampler->start += resampler->phase / L;
+			resampler->phase %= L;
+		}
+
+		// Keep what the next outputs need
+
+		const int consumed = (resampler->start < resampler->filled ? resampler->start : resampler->filled);
+		for (i = 0; i < nChannels; i++) {
+			float* history = &resampler->history[i * resampler->historyFrames];
+			memmove(history, &history[consumed], sizeof(float) * (resampler->filled - consumed));
+		}
+		resampler->filled -= consumed;
+		resampler->start -= consumed;
+	}
+
+	return outFrames;
+}
+
+int p2jaudio_resample_parseQuality(const char* name) {
+	int quality;
+	for (quality = 0; quality < P2JAUDIO_RESAMPLE_QUALITIES; quality++)
+		if (strcmp(name, qualities[quality].name) == 0)
+			return quality;
+	return -1;
+}
+
+const char* p2jaudio_resample_qualityName(int quality) {
+	return qualities[quality].name;
+}
@@ -0,0 +1,50 @@
+/**
+
+Name: p2jaudio_resample.h
+Description: Polyphase resampler, used to convert the audio captured at the native rate of the
+PulseAudio source to the jack rate (see '-R'), on the pulse thread, so outside the realtime thread.
+The ratio of the rates is used exactly (as L/M, reduced by their greatest common divisor),
+each of the L phases is a Kaiser-windowed sinc filter, whose length depends on the quality.
+The samples are interleaved (frames * nChannels), like everywhere else in p2jaudio.
+
+**/
+
+#ifndef P2JAUDIO_RESAMPLE_H
+#define P2JAUDIO_RESAMPLE_H
+
+
+/* quality */
+#define P2JAUDIO_RESAMPLE_LOW		0	/* 8 taps per phase */
+#define P2JAUDIO_RESAMPLE_MEDIUM	1	/* 16 taps per phase */
+#define P2JAUDIO_RESAMPLE_HIGH		2	/* 32 taps per phase */
+#define P2JAUDIO_RESAMPLE_BEST		3	/* 64 taps per phase */
+#define P2JAUDIO_RESAMPLE_QUALITIES	4
+
+/* Maximum amount of phases (L), ratios needing more are not supported */
+#define P2JAUDIO_RESAMPLE_MAX_PHASES	1024
+
+typedef struct p2jaudio_resampler p2jaudio_resampler;
+
+
+/* Returns NULL when out of memory or when the ratio of the rates needs too many phases. */
+p2jaudio_resampler* p2jaudio_resampler_new(int inRate, int outRate, int nChannels, int quality);
+void p2jaudio_resampler_free(p2jaudio_resampler* resampler);
+
+/* Maximum amount of frames returned by p2jaudio_resampler_process() for 'inFrames' frames */
+int p2jaudio_resampler_maxOutFrames(const p2jaudio_resampler* resampler, int inFrames);
+
+/* Converts 'inFrames' frames of 'in' into 'out', and returns the amount of frames written to it.
+   The filter state is kept, so consecutive calls convert a continuous stream. */
+int p2jaudio_resampler_process(p2jaudio_resampler* resampler, const float* in, int inFrames, float* out);
+
+/* Delay added by the filter, in seconds */
+double p2jaudio_resampler_delay(const p2jaudio_resampler* resampler);
+
+/* Taps of each phase */
+int p2jaudio_resampler_taps(const p2jaudio_resampler* resampler);
+
+/* Returns the quality with the given name ('low', 'medium', 'high' or 'best'), or -1 */
+int p2jaudio_resample_parseQuality(const char* name);
+const char* p2jaudio_resample_qualityName(int quality);
+
+#endif
@@ -0,0 +1,153 @@
+/**
+
+Name: p2jaudio_ring.h
+Description: The ring buffer between the pulse thread (writer) and the jack thread (reader).
+It holds interleaved samples, all positions and sizes are in samples (frames * nChannels),
+and since it is only ever written and read in whole frames, they are multiples of nChannels.
+It needs no lock, as long as there is one writer and one reader: the writer only moves writeIndex,
+the reader only moves readIndex, and each of them is on its own cache line.
+
+**/
+
+#ifndef P2JAUDIO_RING_H
+#define P2JAUDIO_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+
+/* Fields written by different threads are kept in different cache lines */
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+
+typedef struct p2jaudio_ring {
+	float*		buffer;
+	int			size;
+
+	/* Written by the writer, the total amount of samples written */
+	uint64_t	writeIndex CACHE_ALIGNED;
+	uint64_t	readIndexCache;	/* last seen readIndex, so the writer seldom reads the line of the reader */
+
+	/* Written by the reader, the total amount of samples read */
+	uint64_t	readIndex CACHE_ALIGNED;
+} p2jaudio_ring;
+
+
+/* While neither the writer nor the reader runs */
+static inline void p2jaudio_ring_init(p2jaudio_ring* ring, float* buffer, int size) {
+	ring->buffer = buffer;
+	ring->size = size;
+	ring->writeIndex = 0;
+	ring->readIndexCache = 0;
+	ring->readIndex = 0;
+}
+
+/* Amount of unread samples, exact for the reader, and at most that for the writer */
+static inline int p2jaudio_ring_fill(const p2jaudio_ring* ring) {
+	const uint64_t readIndex = __atomic_load_n(&ring->readIndex, __ATOMIC_ACQUIRE);
+	return (int)(__atomic_load_n(&ring->writeIndex, __ATOMIC_ACQUIRE) - readIndex);
+}
+
+/* Amount of unread samples as far as the writer knows (at least the real fill), for the writer only:
+   it doesn't read the line of the reader */
+static inline int p2jaudio_ring_writerFill(const p2jaudio_ring* ring) {
+	return (int)(ring->writeIndex - ring->readIndexCache);
+}
+
+/* Reader: drops all unread samples, without moving the write position. */
+static inline void p2jaudio_ring_skip(p2jaudio_ring* ring) {
+	__atomic_store_n(&ring->readIndex, __atomic_load_n(&ring->writeIndex, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+/* Writer: writes 'size' samples with wraparound, as far as they fit,
+   when the ring is full the newest samples are dropped, their amount is returned. */
+static inline int p2jaudio_ring_write(p2jaudio_ring* ring, const float* samples, int size) {
+	const uint64_t writeIndex = ring->writeIndex;
+	if (writeIndex + size - ring->readIndexCache > (uint64_t)ring->size)
+		ring->readIndexCache = __atomic_load_n(&ring->readIndex, __ATOMIC_ACQUIRE);
+
+	const int space = ring->size - (int)(writeIndex - ring->readIndexCache);
+	const int overflow = (size > space ? size - space : 0);
+	size -= overflow;
+
+	const int end = (int)(writeIndex % ring->size);
+	const int firstPartSize = (size < ring->size - end ? size : ring->size - end);
+	memcpy(&ring->buffer[end], &samples[0], sizeof(float) * firstPartSize);
+	memcpy(&ring->buffer[0], &samples[firstPartSize], sizeof(float) * (size - firstPartSize));
+
+	// Publish the samples, once they are in the ring
+	__atomic_store_n(&ring->writeIndex, writeIndex + size, __ATOMIC_RELEASE);
+	return overflow;
+}
+
+/* Copies 'frames' interleaved frames to the channel buffers, starting at frame 'start' of them. */
+static inline void p2jaudio_deinterleave(float** chnls, int nChannels, int start, const float* samples, int frames) {
+	int i, j;
+	if (nChannels == 1) {
+		memcpy(&chnls[0][start], samples, sizeof(float) * frames);
+		return;
+	}
+	for (i = 0; i < nChannels; i++) {
+		float* chnl = &chnls[i][start];
+		const float* sample = &samples[i];
+		for (j = 0; j < frames; j++)
+			chnl[j] = sample[j * nChannels];
+	}
+}
+
+/* Reader: reads 'frames' frames into the channel buffers, and consumes 'dropFrames' frames more:
+   over the period, it crossfades from the samples at the start to those 'dropFrames' further,
+   so the dropped samples don't cause a click.
+   When less than that is buffered, the last period that was written is repeated and everything
+   is consumed, then 1 is returned. The writer leaves that period alone, as long as it writes
+   less than the ring minus a period at once. */
+static inline int p2jaudio_ring_read(p2jaudio_ring* ring, float** chnls, int nChannels, int frames, int dropFrames) {
+	const int periodSize = nChannels * frames;
+	const int readSize = nChannels * (frames + dropFrames);
+	const uint64_t writeIndex = __atomic_load_n(&ring->writeIndex, __ATOMIC_ACQUIRE);
+	uint64_t readIndex = ring->readIndex;
+	int starved = 0;
+	int idx;
+
+	if ((int)(writeIndex - readIndex) < readSize) {
+		// Not enough data: repeat the last period that was written, and consume what's left of it
+		idx = (int)((writeIndex + ring->size - periodSize) % ring->size);
+		readIndex = writeIndex;
+		dropFrames = 0;
+		starved = 1;
+	} else {
+		idx = (int)(readIndex % ring->size);
+		readIndex += readSize;
+	}
+
+	if (dropFrames == 0) {
+		// In at most two parts, split at the end of the ring
+		const int firstPartFrames = (ring->size - idx) / nChannels;
+		if (firstPartFrames >= frames)
+			p2jaudio_deinterleave(chnls, nChannels, 0, &ring->buffer[idx], frames);
+		else {
+			p2jaudio_deinterleave(chnls, nChannels, 0, &ring->buffer[idx], firstPartFrames);
+			p2jaudio_deinterleave(chnls, nChannels, firstPartFrames, &ring->buffer[0], frames - firstPartFrames);
+		}
+	} else {
+		int dropIdx = (idx + nChannels * dropFrames) % ring->size;
+		int i, j;
+		for (j = 0; j < frames; j++) {
+			const float fade = (float)j / frames;
+			for (i = 0; i < nChannels; i++) {
+				chnls[i][j] = ring->buffer[idx] + fade * (ring->buffer[dropIdx] - ring->buffer[idx]);
+				if (++idx == ring->size)
+					idx = 0;
+				if (++dropIdx == ring->size)
+					dropIdx = 0;
+			}
+		}
+	}
+
+	// Hand the samples back to the writer, once they are copied
+	__atomic_store_n(&ring->readIndex, readIndex, __ATOMIC_RELEASE);
+	return starved;
+}
+
+#endif
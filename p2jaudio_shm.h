@@ -0,0 +1,74 @@
+/**
+
+Name: p2jaudio_shm.h
+Description: Layout of the POSIX shared-memory segment in which p2jaudio publishes
+the ring buffer of a pipe (when started with '-s'), so that local programs can
+read the captured audio without a jack connection and without copying it.
+
+The segment is named "/p2jaudio.NAME", where NAME is the name of the pipe with every
+character that is not alphanumeric replaced by '_', it can be opened read-only with
+shm_open(name, O_RDONLY, 0) and mapped with mmap(..., PROT_READ, MAP_SHARED, ...).
+The segment starts with a 'p2jaudio_shm_header', followed (at 'dataOffset' bytes)
+by 'ringSize' interleaved samples.
+
+Reading:
+	- Check 'magic' and 'version', and remember 'writeIndex' as your own read index.
+	- 'writeIndex' only increases, the samples with absolute index i in
+	  [writeIndex - ringSize + P2JAUDIO_SHM_GUARD(header), writeIndex) are valid
+	  and can be found at data[i % ringSize].
+	- 'sequence' is odd while p2jaudio is writing, and increases by 2 for every write,
+	  after consuming samples, check with p2jaudio_shm_overrun() that they weren't
+	  overwritten in the meantime.
+	- When 'active' becomes 0, p2jaudio abandoned the segment (e.g. it restarted with a
+	  different buffer size or rate), unmap it and open it again by name.
+
+**/
+
+#ifndef P2JAUDIO_SHM_H
+#define P2JAUDIO_SHM_H
+
+#include <stdint.h>
+
+
+#define P2JAUDIO_SHM_MAGIC		0x414a3250	/* "P2JA" */
+#define P2JAUDIO_SHM_VERSION	1
+
+/* format */
+#define P2JAUDIO_SHM_FORMAT_FLOAT32	1	/* native endian 32 bit float, interleaved */
+
+#define P2JAUDIO_SHM_PREFIX		"/p2jaudio."
+#define P2JAUDIO_SHM_DATA_OFFSET	64
+
+typedef struct p2jaudio_shm_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	format;
+	uint32_t	channels;
+	uint32_t	rate;
+	uint32_t	ringSize;	/* in samples (frames * channels) */
+	uint32_t	writeSize;	/* maximum amount of samples written at once */
+	uint32_t	dataOffset;	/* in bytes, from the start of the segment */
+	uint32_t	active;
+	uint32_t	reserved;
+	uint64_t	sequence;
+	uint64_t	writeIndex;	/* total amount of samples written */
+} p2jaudio_shm_header;
+
+/* Samples that may be overwritten by the write in progress */
+#define P2JAUDIO_SHM_GUARD(header)	((header)->writeSize)
+
+
+static inline const float* p2jaudio_shm_data(const p2jaudio_shm_header* header) {
+	return (const float*)((const char*)header + header->dataOffset);
+}
+
+static inline uint64_t p2jaudio_shm_writeIndex(const p2jaudio_shm_header* header) {
+	return __atomic_load_n(&header->writeIndex, __ATOMIC_ACQUIRE);
+}
+
+/* Returns non-zero when the sample at 'readIndex' is not (or no longer) valid. */
+static inline int p2jaudio_shm_overrun(const p2jaudio_shm_header* header, uint64_t readIndex) {
+	return p2jaudio_shm_writeIndex(header) + P2JAUDIO_SHM_GUARD(header) > readIndex + header->ringSize;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/**
+
+Name: p2jaudio_trace.h
+Description: Format of the binary trace written by 'p2jaudio -X TRACE_FILE': one record for
+every jack and pulse callback that reached the buffer (so while audio flows), with its time,
+its frames, the fill level of the buffer and the decisions taken (see 'p2jaudio_control.h').
+Every (re)start of the process writes a 'start' record first, with the settings of the buffer.
+Pulse doesn't run the latency control (jack catches up on its reads every period),
+so its records only carry its frames, the fill and its decisions (OVERFLOW, SWITCHED),
+their missedFrames and maxFrames are 0.
+'tools/p2jreplay' runs the latency control of p2jaudio offline on such a trace.
+
+The file starts with a 'p2jaudio_trace_header', followed by 'p2jaudio_trace_record's,
+all in native endianness, so the trace should be replayed on the same architecture.
+
+**/
+
+#ifndef P2JAUDIO_TRACE_H
+#define P2JAUDIO_TRACE_H
+
+#include <stdint.h>
+
+
+#define P2JAUDIO_TRACE_MAGIC	0x52544a50	/* "PJTR" */
+#define P2JAUDIO_TRACE_VERSION	2
+
+/* type */
+#define P2JAUDIO_TRACE_START	0
+#define P2JAUDIO_TRACE_JACK		1
+#define P2JAUDIO_TRACE_PULSE	2
+
+typedef struct p2jaudio_trace_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	recordSize;
+	uint32_t	reserved;
+	double		launchTime;
+} p2jaudio_trace_header;
+
+typedef struct p2jaudio_trace_record {
+	double		time;		/* in seconds, since the epoch */
+	uint16_t	type;
+	uint16_t	decisions;	/* P2JAUDIO_DECISION_* flags */
+	union {
+		struct {
+			int32_t	frames;			/* jack: the period, pulse: the frames written */
+			int32_t	dropFrames;
+			int32_t	fill;			/* of the ring in samples, after the callback */
+			int32_t	missedFrames;	/* jack: after the callback */
+			int32_t	maxFrames;		/* jack: latency, after the callback */
+		} callback;
+		struct {
+			int32_t	rate;
+			int32_t	nChannels;
+			int32_t	periodSize;
+			int32_t	readFrames;
+			int32_t	bufferFrames;
+			int32_t	maxFrames;
+			int32_t	benchmarkStatus;
+		} start;
+	};
+} p2jaudio_trace_record;
+
+#endif
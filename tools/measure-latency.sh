@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Measures the capture latency of p2jaudio with 'p2jlatency', through a PulseAudio null-sink.
+# Works on a headless box: when no jack server is running, one is started with the dummy backend,
+# and when no PulseAudio server is running, one is started as well.
+#
+# Usage: tools/measure-latency.sh [RUNS] [PERIOD_SIZE] [-- extra p2jaudio arguments]
+#
+
+RUNS=${1:-10}
+PERIOD=${2:-256}
+RATE=${RATE:-48000}
+SINK=p2jlatency
+PIPE=p2jlatency-pipe
+
+[ $# -ge 1 ] && shift
+[ $# -ge 1 ] && shift
+[ "$1" = "--" ] && shift
+
+cd "$(dirname "$0")/.." || exit 1
+
+JACKD_PID=
+P2JAUDIO_PID=
+MODULE=
+PULSE_STARTED=
+LOG=$(mktemp) || exit 1
+
+cleanup() {
+	[ -n "$P2JAUDIO_PID" ] && kill "$P2JAUDIO_PID" 2>/dev/null && wait "$P2JAUDIO_PID" 2>/dev/null
+	[ -n "$MODULE" ] && pactl unload-module "$MODULE"
+	[ -n "$JACKD_PID" ] && kill "$JACKD_PID" 2>/dev/null
+	[ -n "$PULSE_STARTED" ] && pulseaudio --kill
+	rm -f "$LOG"
+}
+trap cleanup EXIT INT TERM
+
+if ! jack_lsp >/dev/null 2>&1; then
+	echo "Starting jackd with the dummy backend ($RATE Hz, $PERIOD frames)..."
+	jackd -d dummy -r "$RATE" -p "$PERIOD" >/dev/null 2>&1 &
+	JACKD_PID=$!
+	TRIES=0
+	until jack_lsp >/dev/null 2>&1; do
+		TRIES=$((TRIES + 1))
+		if [ $TRIES -ge 50 ] || ! kill -0 "$JACKD_PID" 2>/dev/null; then
+			echo "jackd did not start."
+			exit 1
+		fi
+		sleep 0.1
+	done
+fi
+
+if ! pactl info >/dev/null 2>&1; then
+	echo "Starting PulseAudio..."
+	pulseaudio --start --exit-idle-time=-1 || exit 1
+	PULSE_STARTED=1
+fi
+
+MODULE=$(pactl load-module module-null-sink sink_name=$SINK rate="$RATE" channels=1) || exit 1
+
+# The benchmark is skipped when the latency is given
+BENCHMARK=1
+for ARG in "$@"; do
+	case "$ARG" in
+		-l*|--latency*) BENCHMARK= ;;
+	esac
+done
+
+# Line buffered, so the log can be polled while the pipe runs
+PULSE_SOURCE=$SINK.monitor stdbuf -oL ./p2jaudio -n $PIPE -c 1 "$@" >"$LOG" 2>&1 &
+P2JAUDIO_PID=$!
+
+# Prints the output of the pipe and quits when it stops before line $1 appears in it within $2 seconds
+waitForLog() {
+	TRIES=0
+	until grep -q "$1" "$LOG"; do
+		TRIES=$((TRIES + 1))
+		if ! kill -0 "$P2JAUDIO_PID" 2>/dev/null || [ $TRIES -ge $(($2 * 10)) ]; then
+			cat "$LOG"
+			echo "p2jaudio did not report '$1' within ${2}s."
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+# Wait until the pipe produces audio, and until the benchmark reduced the buffer to the calibrated latency
+waitForLog "^First audio after" 30
+[ -n "$BENCHMARK" ] && waitForLog "^Benchmark ended" 30
+cat "$LOG"
+
+./tools/p2jlatency -p "$PIPE (p2jaudio):mono" -s $SINK -r "$RUNS"
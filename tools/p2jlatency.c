@@ -0,0 +1,323 @@
+/**
+
+Name: p2jlatency
+Description: Measures the real capture latency of a p2jaudio pipe.
+A known signal (a maximum length sequence, or a single impulse) is played into a
+PulseAudio sink (normally a null-sink), whose monitor source is captured by p2jaudio,
+and the output port of p2jaudio is recorded by this jack client.
+The arrival of the signal is found by cross-correlation, and compared with the time
+it was played, using the jack clock for both sides.
+The latency is reported per run to the sample, together with its mean and variance.
+See 'measure-latency.sh' for running it on a headless box.
+
+**/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <jack/jack.h>
+#include <pulse/simple.h>
+#include <pulse/error.h>
+
+
+#define CAPTURE_TIME 8.0
+#define SETTLE_TIME 0.5
+#define SEARCH_BEFORE_TIME 0.1
+#define SEARCH_AFTER_TIME 2.0
+#define SIGNAL_LEVEL 0.5
+#define PULSE_TARGET_LATENCY 0.02
+
+#define DEFAULT_RUNS 10
+#define DEFAULT_MLS_ORDER 12
+
+
+typedef jack_default_audio_sample_t jack_sample_t;
+
+static jack_client_t*	jackClient;
+static jack_port_t*		inputPort;
+static int				rate;
+
+/* Ring of the captured samples, indexed by the absolute jack frame time */
+static float*			capture;
+static int				captureSize;
+static jack_nframes_t	captureEndFrame;
+
+static float*			testSignal;
+static int				testSignalSize;
+
+
+static int jack_process(jack_nframes_t frames, void* arg)
+{
+	const jack_sample_t* in = (jack_sample_t*) jack_port_get_buffer(inputPort, frames);
+	const jack_nframes_t startFrame = jack_last_frame_time(jackClient);
+	jack_nframes_t j;
+
+	for (j = 0; j < frames; j++)
+		capture[(startFrame + j) % captureSize] = in[j];
+
+	__atomic_store_n(&captureEndFrame, startFrame + frames, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Maximum length sequence of 2^order - 1 samples, generated by a Galois LFSR */
+static int createMls(int order)
+{
+	static const unsigned int taps[] = {
+		0, 0, 0x3, 0x6, 0xC, 0x14, 0x30, 0x60, 0xB8, 0x110, 0x240, 0x500, 0x829, 0x100D, 0x2015, 0x6000, 0xD008 };
+	unsigned int lfsr = 1;
+	int i;
+
+	testSignalSize = (1 << order) - 1;
+	if ((testSignal = malloc(sizeof(float) * testSignalSize)) == NULL)
+		return -1;
+
+	for (i = 0; i < testSignalSize; i++) {
+		testSignal[i] = (lfsr & 1) ? SIGNAL_LEVEL : -SIGNAL_LEVEL;
+		lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & taps[order]);
+	}
+	return 0;
+}
+
+static int createImpulse()
+{
+	testSignalSize = 1;
+	if ((testSignal = malloc(sizeof(float))) == NULL)
+		return -1;
+	testSignal[0] = 1.0;
+	return 0;
+}
+
+/* Returns the absolute frame of the best match of the test signal, within [from, to) */
+static jack_nframes_t findSignal(jack_nframes_t from, jack_nframes_t to, double* peak)
+{
+	jack_nframes_t best = from;
+	double bestValue = 0;
+	jack_nframes_t f;
+	int i;
+
+	for (f = from; (int)(to - f) > 0; f++) {
+		double sum = 0;
+		for (i = 0; i < testSignalSize; i++)
+			sum += testSignal[i] * capture[(f + i) % captureSize];
+		if (fabs(sum) > bestValue) {
+			bestValue = fabs(sum);
+			best = f;
+		}
+	}
+
+	*peak = bestValue;
+	return best;
+}
+
+static int writeSilence(pa_simple* stream, double time)
+{
+	int frames = (int)(rate * time);
+	float silence[1024];
+	int error;
+
+	memset(silence, 0, sizeof(silence));
+	while (frames > 0) {
+		const int n = frames < 1024 ? frames : 1024;
+		if (pa_simple_write(stream, silence, sizeof(float) * n, &error) < 0) {
+			fprintf(stderr, __FILE__": pa_simple_write() failed: %s\n", pa_strerror(error));
+			return -1;
+		}
+		frames -= n;
+	}
+	return 0;
+}
+
+/* Performs one run, stores the latency in frames in '*latency', returns -1 on failure */
+static int measure(pa_simple* stream, double* latency)
+{
+	int error;
+
+	if (writeSilence(stream, SETTLE_TIME) == -1)
+		return -1;
+
+	// Time at which the first sample of the signal will be played
+
+	const pa_usec_t playbackLatency = pa_simple_get_latency(stream, &error);
+	if (playbackLatency == (pa_usec_t)-1) {
+		fprintf(stderr, __FILE__": pa_simple_get_latency() failed: %s\n", pa_strerror(error));
+		return -1;
+	}
+	const jack_time_t playTime = jack_get_time() + playbackLatency;
+
+	if (pa_simple_write(stream, testSignal, sizeof(float) * testSignalSize, &error) < 0) {
+		fprintf(stderr, __FILE__": pa_simple_write() failed: %s\n", pa_strerror(error));
+		return -1;
+	}
+	if (writeSilence(stream, SEARCH_AFTER_TIME) == -1)
+		return -1;
+	usleep(1000000 * (SEARCH_BEFORE_TIME + (double)playbackLatency / 1000000));
+
+	// Search the captured signal around the time it was played
+
+	const jack_nframes_t endFrame = __atomic_load_n(&captureEndFrame, __ATOMIC_ACQUIRE);
+	const jack_nframes_t playFrame = endFrame -
+			(jack_nframes_t)((double)(jack_frames_to_time(jackClient, endFrame) - playTime) * rate / 1000000);
+	const jack_nframes_t searchFrom = playFrame - (jack_nframes_t)(SEARCH_BEFORE_TIME * rate);
+	const jack_nframes_t searchTo = endFrame - testSignalSize;
+
+	if ((int)(endFrame - searchFrom) > captureSize || (int)(searchTo - searchFrom) <= 0) {
+		printf ("Capture window is out of range, is the jack port connected?\n");
+		return -1;
+	}
+
+	double peak;
+	const jack_nframes_t arrivalFrame = findSignal(searchFrom, searchTo, &peak);
+	if (peak < 0.25 * SIGNAL_LEVEL * testSignalSize * SIGNAL_LEVEL) {
+		printf ("Signal not found (peak correlation %f), is p2jaudio recording from the monitor of the sink?\n", peak);
+		return -1;
+	}
+
+	const jack_time_t arrivalTime = jack_frames_to_time(jackClient, arrivalFrame);
+	*latency = ((double)arrivalTime - (double)playTime) * rate / 1000000;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	static struct option long_options[] = {
+		{"help",    no_argument,       0, 'h'},
+		{"port",    required_argument, 0, 'p'},
+		{"sink",    required_argument, 0, 's'},
+		{"runs",    required_argument, 0, 'r'},
+		{"mls",     required_argument, 0, 'm'},
+		{"impulse", no_argument,       0, 'i'},
+		{0, 0, 0, 0}
+	};
+	const char* portName = NULL;
+	const char* sinkName = NULL;
+	int runs = DEFAULT_RUNS;
+	int mlsOrder = DEFAULT_MLS_ORDER;
+	int useImpulse = 0;
+	int doesUserNeedHelp = 0;
+	int c, option_index;
+
+	while ((c = getopt_long(argc, argv, "hp:s:r:m:i", long_options, &option_index)) != -1) {
+		switch (c) {
+			case 'p': portName = optarg; break;
+			case 's': sinkName = optarg; break;
+			case 'r': runs = atoi(optarg); break;
+			case 'm': mlsOrder = atoi(optarg); break;
+			case 'i': useImpulse = 1; break;
+			default: doesUserNeedHelp = 1; break;
+		}
+	}
+
+	if (doesUserNeedHelp || optind < argc || portName == NULL || runs <= 0 || mlsOrder < 2 || mlsOrder > 16) {
+		printf (
+"\
+Usage: \t %s -p PORT [-s SINK] [-r RUNS] [-m ORDER | -i] \n\
+\n\
+Measures the capture latency of a p2jaudio pipe, by playing a test signal into the \n\
+PulseAudio sink SINK, of which p2jaudio should record the monitor source, \n\
+and finding it back on the jack output port PORT of p2jaudio. \n\
+\n\
+Options: \n\
+\t -p, --port=PORT    the jack output port of the pipe, e.g. 'p2jaudio:mono' \n\
+\t -s, --sink=SINK    the PulseAudio sink to play into (default: the default sink) \n\
+\t -r, --runs=RUNS    amount of measurements (default: %d) \n\
+\t -m, --mls=ORDER    use a maximum length sequence of 2^ORDER-1 samples, 2..16 (default: %d) \n\
+\t -i, --impulse      use a single impulse instead of a maximum length sequence \n\
+\t -h, --help         prints this help-message \n\
+",
+				argv[0], DEFAULT_RUNS, DEFAULT_MLS_ORDER);
+		return 0;
+	}
+
+	if ((useImpulse ? createImpulse() : createMls(mlsOrder)) == -1) {
+		printf ("Failed to allocate the test signal.\n");
+		return 1;
+	}
+
+	// Start jack
+
+	if ((jackClient = jack_client_open("p2jlatency", JackNoStartServer, NULL)) == 0) {
+		printf ("Failed to open jack client.\n");
+		return 1;
+	}
+	rate = jack_get_sample_rate(jackClient);
+	captureSize = (int)(CAPTURE_TIME * rate);
+	if ((capture = calloc(captureSize, sizeof(float))) == NULL) {
+		printf ("Failed to allocate the capture buffer.\n");
+		jack_client_close(jackClient);
+		return 1;
+	}
+	inputPort = jack_port_register(jackClient, "in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+	jack_set_process_callback(jackClient, jack_process, 0);
+	if (jack_activate(jackClient) != 0 ||
+			jack_connect(jackClient, portName, jack_port_name(inputPort)) != 0) {
+		printf ("Failed to activate jack client or to connect '%s'.\n", portName);
+		jack_client_close(jackClient);
+		return 1;
+	}
+
+	// Start pulse
+
+	const pa_sample_spec ss = {
+		.format = PA_SAMPLE_FLOAT32LE,
+		.rate = rate,
+		.channels = 1
+	};
+	const pa_buffer_attr attr = {
+		.maxlength = (uint32_t)-1,
+		.tlength = (uint32_t)(sizeof(float) * PULSE_TARGET_LATENCY * rate),
+		.prebuf = (uint32_t)-1,
+		.minreq = (uint32_t)-1,
+		.fragsize = (uint32_t)-1
+	};
+	int error;
+	pa_simple* stream;
+	if (!(stream = pa_simple_new(NULL, "p2jlatency", PA_STREAM_PLAYBACK, sinkName, "latency test signal", &ss, NULL, &attr, &error))) {
+		fprintf(stderr, __FILE__": pa_simple_new() failed: %s\n", pa_strerror(error));
+		jack_client_close(jackClient);
+		return 1;
+	}
+
+	// Measure
+
+	printf ("Measuring latency of '%s' at %dHz with a %s of %d samples...\n",
+			portName, rate, useImpulse ? "impulse" : "maximum length sequence", testSignalSize);
+
+	double sum = 0, sumSquares = 0, min = 0, max = 0;
+	int successes = 0;
+	int i;
+	for (i = 0; i < runs; i++) {
+		double latency;
+		if (measure(stream, &latency) == -1)
+			continue;
+
+		printf ("Run %d: %.0f frames = %fms\n", i + 1, latency, 1000 * latency / rate);
+		if (successes == 0 || latency < min)
+			min = latency;
+		if (successes == 0 || latency > max)
+			max = latency;
+		sum += latency;
+		sumSquares += latency * latency;
+		successes++;
+	}
+
+	if (successes > 0) {
+		const double mean = sum / successes;
+		const double variance = sumSquares / successes - mean * mean;
+		printf ("Latency over %d runs: mean %.1f frames (%fms), variance %.1f frames^2 (stddev %fms), min %.0f, max %.0f frames.\n",
+				successes, mean, 1000 * mean / rate, variance, 1000 * sqrt(fmax(variance, 0)) / rate, min, max);
+	} else
+		printf ("No successful runs.\n");
+
+	pa_simple_free(stream);
+	jack_deactivate(jackClient);
+	jack_client_close(jackClient);
+	free(capture);
+	free(testSignal);
+
+	return successes > 0 ? 0 : 1;
+}
@@ -0,0 +1,247 @@
+/**
+
+Name: p2jreplay
+Description: Replays a trace of the callbacks of p2jaudio (recorded with 'p2jaudio -X TRACE_FILE',
+see 'p2jaudio_trace.h') offline: the latency control of p2jaudio (see 'p2jaudio_control.h') is run
+on the recorded arrival pattern of the jack periods and pulse reads, with an empty ring of the same size,
+and its decisions are compared with the recorded ones.
+So after changing the heuristics in 'p2jaudio_control.h', rebuilding this tool and replaying the
+trace of an incident shows whether the change would have prevented it.
+
+**/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "p2jaudio_control.h"
+#include "p2jaudio_trace.h"
+
+
+#define DECISIONS 9
+
+static const char* decisionNames[DECISIONS] = {
+	"late", "reset", "shutdown", "calibrated", "silence", "drop", "starved", "overflow", "switched"
+};
+
+
+static p2jaudio_control	control;
+static p2jaudio_ring	ring;
+static float*			samples;
+
+/* What pulse published, which jack catches up on in the latency control */
+static long long		pulseFrames;
+static int				pulseSwitches;
+static float**			chnls;
+
+static int				recordedCounts[DECISIONS];
+static int				replayedCounts[DECISIONS];
+
+
+static void freeBuffers() {
+	free(ring.buffer);
+	ring.buffer = NULL;
+	free(samples);
+	samples = NULL;
+	if (chnls != NULL)
+		free(chnls[0]);
+	free(chnls);
+	chnls = NULL;
+}
+
+/* Same as startProcess() and initBuffer() of p2jaudio, from the settings in the record */
+static int startReplay(const p2jaudio_trace_record* record) {
+	const int nChannels = record->start.nChannels;
+	const int maxFrames = (record->start.periodSize > record->start.readFrames ? record->start.periodSize : record->start.readFrames);
+	int i;
+
+	freeBuffers();
+	if ((ring.buffer = calloc(nChannels * record->start.bufferFrames, sizeof(float))) == NULL ||
+			(samples = calloc(nChannels * maxFrames, sizeof(float))) == NULL ||
+			(chnls = malloc(sizeof(float*) * nChannels)) == NULL ||
+			(chnls[0] = malloc(sizeof(float) * nChannels * maxFrames)) == NULL) {
+		printf ("Failed to allocate the buffers.\n");
+		return -1;
+	}
+	for (i = 1; i < nChannels; i++)
+		chnls[i] = &chnls[0][i * maxFrames];
+
+	p2jaudio_ring_init(&ring, ring.buffer, nChannels * record->start.bufferFrames);
+	pulseFrames = 0;
+	pulseSwitches = 0;
+	control.benchmarkStatus = record->start.benchmarkStatus;
+	p2jaudio_control_init(&control, record->start.rate, nChannels, record->start.periodSize,
+			record->start.readFrames, record->start.bufferFrames, record->start.maxFrames);
+	return 0;
+}
+
+static void countDecisions(int* counts, int decisions) {
+	int i;
+	for (i = 0; i < DECISIONS; i++)
+		if (decisions & (1 << i))
+			counts[i]++;
+}
+
+static void printDecisions(int decisions) {
+	int i;
+	if (decisions == 0)
+		printf (" -");
+	for (i = 0; i < DECISIONS; i++)
+		if (decisions & (1 << i))
+			printf (" %s", decisionNames[i]);
+}
+
+static int replay(const char* fileName, int verbose) {
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL) {
+		printf ("Failed to open '%s'.\n", fileName);
+		return -1;
+	}
+
+	p2jaudio_trace_header header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != P2JAUDIO_TRACE_MAGIC ||
+			header.version != P2JAUDIO_TRACE_VERSION || header.recordSize != sizeof(p2jaudio_trace_record)) {
+		printf ("'%s' is not a compatible p2jaudio trace.\n", fileName);
+		fclose(file);
+		return -1;
+	}
+
+	p2jaudio_trace_record record;
+	int started = 0, shutdown = 0;
+	int starts = 0, jackCallbacks = 0, pulseCallbacks = 0, differences = 0;
+	int recordedMaxFrames = 0;
+	double firstTime = 0, lastTime = 0;
+
+	while (!shutdown && fread(&record, sizeof(record), 1, file) == 1) {
+		int decisions = 0;
+
+		if (firstTime == 0)
+			firstTime = record.time;
+		lastTime = record.time;
+
+		switch (record.type) {
+			case P2JAUDIO_TRACE_START:
+				printf ("%10.3fs: start, %d*%dHz, period of %d frames, reads of %d frames, latency of %d frames.\n",
+						record.time - header.launchTime, record.start.nChannels, record.start.rate,
+						record.start.periodSize, record.start.readFrames, record.start.maxFrames);
+				if (startReplay(&record) == -1) {
+					fclose(file);
+					return -1;
+				}
+				started = 1;
+				starts++;
+				continue;
+
+			case P2JAUDIO_TRACE_JACK: {
+				if (!started)
+					continue;
+				// The first period in which both sides run is the one that starts the benchmark
+				if (control.benchmarkStatus == -1)
+					p2jaudio_control_initBenchmark(&control);
+				int dropFrames;
+				decisions = p2jaudio_control_jack(&control, &ring, record.callback.frames, pulseFrames, pulseSwitches, record.time, &dropFrames);
+				p2jaudio_control_printMessage(&control.message);
+				if (!(decisions & (P2JAUDIO_DECISION_SHUTDOWN | P2JAUDIO_DECISION_SILENCE)) &&
+						p2jaudio_ring_read(&ring, chnls, control.nChannels, record.callback.frames, dropFrames))
+					decisions |= P2JAUDIO_DECISION_STARVED;
+				recordedMaxFrames = record.callback.maxFrames;
+				jackCallbacks++;
+				break;
+			}
+
+			case P2JAUDIO_TRACE_PULSE:
+				if (!started)
+					continue;
+				if (p2jaudio_ring_write(&ring, samples, control.nChannels * record.callback.frames) > 0)
+					decisions |= P2JAUDIO_DECISION_OVERFLOW;
+				// Switching sources isn't replayed, only the recalibration after it, which jack does
+				if (record.decisions & P2JAUDIO_DECISION_SWITCHED) {
+					pulseSwitches++;
+					decisions |= P2JAUDIO_DECISION_SWITCHED;
+				}
+				pulseFrames += record.callback.frames;
+				pulseCallbacks++;
+				break;
+
+			default:
+				printf ("Unknown record type %d.\n", record.type);
+				fclose(file);
+				return -1;
+		}
+
+		countDecisions(recordedCounts, record.decisions);
+		countDecisions(replayedCounts, decisions);
+
+		if (decisions != record.decisions) {
+			differences++;
+			if (verbose) {
+				printf ("%10.3fs: %s of %d frames, recorded:", record.time - header.launchTime,
+						record.type == P2JAUDIO_TRACE_JACK ? "jack period" : "pulse read", record.callback.frames);
+				printDecisions(record.decisions);
+				printf (" (fill %d), replayed:", record.callback.fill);
+				printDecisions(decisions);
+				printf (" (fill %d).\n", p2jaudio_ring_fill(&ring));
+			}
+		}
+
+		if (decisions & P2JAUDIO_DECISION_SHUTDOWN) {
+			printf ("%10.3fs: the replayed pipe shuts down here.\n", record.time - header.launchTime);
+			shutdown = 1;
+		}
+	}
+
+	fclose(file);
+	freeBuffers();
+
+	printf ("\nReplayed %d jack periods and %d pulse reads over %fs, in %d starts.\n",
+			jackCallbacks, pulseCallbacks, lastTime - firstTime, starts);
+	printf ("%-12s %10s %10s\n", "decision", "recorded", "replayed");
+	int i;
+	for (i = 0; i < DECISIONS; i++)
+		printf ("%-12s %10d %10d\n", decisionNames[i], recordedCounts[i], replayedCounts[i]);
+	printf ("Final latency: recorded %d frames, replayed %d frames.\n", recordedMaxFrames, control.maxFrames);
+	printf ("Decisions differed in %d callbacks.\n", differences);
+
+	return differences > 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+	int verbose = 0;
+	int doesUserNeedHelp = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "vh")) != -1) {
+		switch (c) {
+			case 'v':
+				verbose = 1;
+				break;
+
+			default:
+				doesUserNeedHelp = 1;
+				break;
+		}
+	}
+
+	if (doesUserNeedHelp || optind != argc - 1) {
+		printf (
+"\
+Usage: \t %s [-v] TRACE_FILE \n\
+\n\
+Replays the trace TRACE_FILE recorded with 'p2jaudio -X TRACE_FILE' through the latency control \n\
+of this build, and compares its decisions with the recorded ones. \n\
+Exits with 0 when they are the same, 1 when they differ. \n\
+\n\
+Options: \n\
+\t -v  print every callback of which the decisions differ \n\
+\t -h  prints this help-message \n\
+",
+				argv[0]);
+		return 0;
+	}
+
+	const int ret = replay(argv[optind], verbose);
+	return ret == -1 ? 2 : ret;
+}
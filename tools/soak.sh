@@ -0,0 +1,212 @@
+#!/bin/sh
+#
+# Soak test of p2jaudio: runs PIPES pipes for DURATION seconds at each jack period size in PERIODS,
+# on a jack server with the dummy backend, capturing the monitor source of a PulseAudio null-sink,
+# so it runs on a headless box without audio hardware (a PulseAudio server is started when needed).
+# Every INTERVAL seconds, the jack xruns, buffer underruns and latency reported by each pipe,
+# and its CPU usage and RSS (from /proc), are appended to 'soak/soak.csv'.
+# The summary of each period size is appended to 'soak/soak-summary.csv', with the version
+# of the tree, so the files of two versions can be compared. The output of the pipes is kept in 'soak/'.
+# With MODES="low-latency throughput", every period size is soaked in both modes (see '-t'),
+# so their CPU usage can be compared in the summary.
+#
+# Usage: [MODES=...] tools/soak.sh [PIPES] [DURATION] [PERIODS] [-- extra p2jaudio arguments]
+#	e.g. tools/soak.sh 4 600 "32 64 128" -- -q low
+#
+
+PIPES=${1:-4}
+DURATION=${2:-60}
+PERIODS=${3:-"32 64 128"}
+RATE=${RATE:-48000}
+INTERVAL=${INTERVAL:-5}
+MODES=${MODES:-low-latency}
+SOAK_DIR=${SOAK_DIR:-soak}
+SINK=p2jsoak
+SERVER=p2jsoak
+
+[ $# -ge 1 ] && shift
+[ $# -ge 1 ] && shift
+[ $# -ge 1 ] && shift
+[ "$1" = "--" ] && shift
+
+cd "$(dirname "$0")/.." || exit 1
+
+if [ ! -x ./p2jaudio ]; then
+	echo "Build p2jaudio first (run 'make')."
+	exit 1
+fi
+
+# A jack server of its own, so the period size can be set, whatever else is running
+export JACK_DEFAULT_SERVER=$SERVER
+
+JACKD_PID=
+PACAT_PID=
+PIPE_PIDS=
+MODULE=
+PULSE_STARTED=
+
+stopPipes() {
+	for PID in $PIPE_PIDS; do
+		kill "$PID" 2>/dev/null
+	done
+	for PID in $PIPE_PIDS; do
+		wait "$PID" 2>/dev/null
+	done
+	PIPE_PIDS=
+}
+
+stopJack() {
+	[ -n "$JACKD_PID" ] && kill "$JACKD_PID" 2>/dev/null && wait "$JACKD_PID" 2>/dev/null
+	JACKD_PID=
+}
+
+cleanup() {
+	stopPipes
+	stopJack
+	[ -n "$PACAT_PID" ] && kill "$PACAT_PID" 2>/dev/null
+	[ -n "$MODULE" ] && pactl unload-module "$MODULE"
+	[ -n "$PULSE_STARTED" ] && pulseaudio --kill
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+if ! pactl info >/dev/null 2>&1; then
+	echo "Starting PulseAudio..."
+	pulseaudio --start --exit-idle-time=-1 || exit 1
+	PULSE_STARTED=1
+fi
+
+MODULE=$(pactl load-module module-null-sink sink_name=$SINK rate="$RATE" channels=2) || exit 1
+
+# Noise into the sink, so the pipes carry a signal rather than the silence of an idle monitor
+if command -v pacat >/dev/null 2>&1; then
+	pacat -p -d $SINK --format=s16le --rate="$RATE" --channels=2 < /dev/urandom &
+	PACAT_PID=$!
+fi
+
+mkdir -p "$SOAK_DIR" || exit 1
+CSV=$SOAK_DIR/soak.csv
+SUMMARY=$SOAK_DIR/soak-summary.csv
+VERSION=$(git describe --always --dirty 2>/dev/null || echo unknown)
+CLK_TCK=$(getconf CLK_TCK)
+
+echo "mode,period,pipe,time,state,xruns,underruns,latency_ms,cpu_percent,rss_kb" > "$CSV"
+SUMMARY_HEADER="version,mode,period,pipes,duration,xruns,underruns,shutdowns,latency_ms_mean,latency_ms_max,cpu_percent_mean,rss_kb_max"
+# A summary without the mode column is kept aside, rather than appended to
+if [ -f "$SUMMARY" ] && [ "$(head -n 1 "$SUMMARY")" != "$SUMMARY_HEADER" ]; then
+	mv "$SUMMARY" "$SUMMARY.old"
+fi
+[ -f "$SUMMARY" ] || echo "$SUMMARY_HEADER" > "$SUMMARY"
+
+now() {
+	date +%s.%N
+}
+
+# Prints 'utime+stime' in clock ticks and the RSS in kB of process $1, nothing when it has exited
+procStats() {
+	[ -r "/proc/$1/stat" ] || return
+	PROC_TICKS=$(sed 's/^.*) //' "/proc/$1/stat" | awk '{ print $12 + $13 }')
+	PROC_RSS=$(awk '/^VmRSS:/ { print $2 }' "/proc/$1/status" 2>/dev/null)
+	[ -n "$PROC_TICKS" ] && echo "$PROC_TICKS ${PROC_RSS:-0}"
+}
+
+# Prints the xruns, underruns and latency (in ms, '-' before the benchmark ended) reported in log $1
+logStats() {
+	awk '
+		/^Jack xruns: / { xruns = $3 + 0 }
+		/^Buffer underrun\./ { underruns++ }
+		/latency of .*ms;/ { match($0, /latency of [0-9.]+ms/); latency = substr($0, RSTART + 11, RLENGTH - 13) + 0 }
+		END { printf "%d %d %s\n", xruns, underruns + 0, (latency == "" ? "-" : latency) }
+	' "$1"
+}
+
+for MODE in $MODES; do
+case "$MODE" in
+	low-latency) MODE_ARGS= ;;
+	throughput) MODE_ARGS=-t ;;
+	*) echo "Unknown mode '$MODE', use 'low-latency' or 'throughput'."; exit 1 ;;
+esac
+
+for PERIOD in $PERIODS; do
+	echo "Soaking $PIPES pipes at $RATE Hz, periods of $PERIOD frames, in $MODE mode, for ${DURATION}s..."
+
+	jackd -n $SERVER -d dummy -r "$RATE" -p "$PERIOD" >"$SOAK_DIR/jackd.$PERIOD.log" 2>&1 &
+	JACKD_PID=$!
+	TRIES=0
+	until jack_lsp >/dev/null 2>&1; do
+		TRIES=$((TRIES + 1))
+		if [ $TRIES -ge 50 ] || ! kill -0 "$JACKD_PID" 2>/dev/null; then
+			echo "jackd did not start, see '$SOAK_DIR/jackd.$PERIOD.log'."
+			exit 1
+		fi
+		sleep 0.1
+	done
+
+	I=1
+	while [ $I -le "$PIPES" ]; do
+		# Line buffered, so the log can be followed while the pipe runs
+		PULSE_SOURCE=$SINK.monitor stdbuf -oL ./p2jaudio -n "soak-$I" $MODE_ARGS "$@" >"$SOAK_DIR/pipe.$MODE.$PERIOD.$I.log" 2>&1 &
+		PIPE_PIDS="$PIPE_PIDS $!"
+		eval "TICKS_$I=0"
+		I=$((I + 1))
+	done
+
+	START=$(now)
+	LAST=$START
+	ELAPSED=0
+	while awk -v e="$ELAPSED" -v d="$DURATION" 'BEGIN { exit !(e < d) }'; do
+		sleep "$INTERVAL"
+		NOW=$(now)
+		ELAPSED=$(awk -v n="$NOW" -v s="$START" 'BEGIN { printf "%.1f", n - s }')
+		WALL=$(awk -v n="$NOW" -v l="$LAST" 'BEGIN { print n - l }')
+		LAST=$NOW
+
+		I=1
+		for PID in $PIPE_PIDS; do
+			LOG=$SOAK_DIR/pipe.$MODE.$PERIOD.$I.log
+			# 'read' rather than 'set --', which would lose the extra p2jaudio arguments
+			read XRUNS UNDERRUNS LATENCY <<-EOF
+				$(logStats "$LOG")
+			EOF
+			read TICKS RSS <<-EOF
+				$(procStats "$PID")
+			EOF
+			if [ -n "$TICKS" ]; then
+				eval "PREVIOUS=\$TICKS_$I"
+				eval "TICKS_$I=$TICKS"
+				CPU=$(awk -v t="$TICKS" -v p="$PREVIOUS" -v c="$CLK_TCK" -v w="$WALL" 'BEGIN { printf "%.2f", 100 * (t - p) / c / w }')
+				echo "$MODE,$PERIOD,$I,$ELAPSED,running,$XRUNS,$UNDERRUNS,$LATENCY,$CPU,$RSS" >> "$CSV"
+			else
+				echo "$MODE,$PERIOD,$I,$ELAPSED,stopped,$XRUNS,$UNDERRUNS,$LATENCY,-,-" >> "$CSV"
+			fi
+			I=$((I + 1))
+		done
+	done
+
+	stopPipes
+	stopJack
+
+	# The CPU usage over the whole run, as reported by each pipe when it quits
+	CPU_MEAN=$(cat "$SOAK_DIR"/pipe."$MODE"."$PERIOD".*.log | awk '
+		/^CPU usage of this pipe/ { sub(/%.*/, "", $9); sum += $9; n++ }
+		END { if (n) printf "%.2f", sum / n; else printf "-" }')
+	SHUTDOWNS=$(cat "$SOAK_DIR"/pipe."$MODE"."$PERIOD".*.log | grep -c "^Shutting down")
+
+	# Jack reports every xrun of the server to each client, so the xruns are those of the server
+	awk -F, -v mode="$MODE" -v period="$PERIOD" -v version="$VERSION" -v pipes="$PIPES" -v duration="$DURATION" \
+			-v shutdowns="$SHUTDOWNS" -v cpu="$CPU_MEAN" '
+		$1 == mode && $2 == period { xruns[$3] = $6; underruns[$3] = $7; latency[$3] = $8; if ($10 != "-" && $10 > rss) rss = $10 }
+		END {
+			for (p in xruns) {
+				if (xruns[p] > maxXruns) maxXruns = xruns[p]
+				totalUnderruns += underruns[p]
+				if (latency[p] != "-") { sum += latency[p]; n++; if (latency[p] > maxLatency) maxLatency = latency[p] }
+			}
+			printf "%s,%s,%d,%d,%d,%d,%d,%d,%s,%s,%s,%d\n", version, mode, period, pipes, duration, maxXruns, totalUnderruns, shutdowns,
+					(n ? sprintf("%.3f", sum / n) : "-"), (n ? sprintf("%.3f", maxLatency) : "-"), cpu, rss
+		}' "$CSV" >> "$SUMMARY"
+done
+done
+
+echo
+column -s, -t < "$SUMMARY" 2>/dev/null || cat "$SUMMARY"